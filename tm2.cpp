@@ -1,13 +1,197 @@
 #include <iostream>
     using std::cout;
-#include <deque>
 #include <vector>
 #include <utility>
+#include <functional>                   // std::less
+#include <chrono>                       // std::chrono::steady_clock
 #include <assert.h>
 
-typedef unsigned int data_t;
+/*
+    How much tracing gets compiled in: 0 none at all, 1 the tapes at
+    the start and end of a pass, 2 the tapes every time sort() moves a
+    value (which makes it O(n^2)).  Builds with NDEBUG leave it out
+    unless told otherwise.  A trace site whose level is above
+    TRACE_LEVEL is dead code: it still has to compile, but none of it
+    makes it into the program.
+*/
+
+#ifndef TRACE_LEVEL
+#ifdef NDEBUG
+#define TRACE_LEVEL 0
+#else
+#define TRACE_LEVEL 1
+#endif
+#endif
+
+#define TRACE(level, call) \
+    do { if (TRACE_LEVEL >= (level)) call; } while (0)
+
+typedef unsigned int data_t;            // the default record
+
+/*!
+    What a tape has done since it was made: values read off it, values
+    written onto it, and rewinds.
+*/
+
+struct tape_meter
+{
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long rewinds;
+};
+
+/*!
+    'Less', counting how often it gets asked.
+*/
+
+unsigned long long compared;
+
+template <class Less>
+struct counted_less
+{
+    template <class T>
+    bool operator()(const T &a, const T &b) const
+    {
+        ++compared;
+        return Less()(a, b);
+    }
+};
+
+/*!
+    'Less' with the counting taken off, for the tapes' own bookkeeping:
+    only the merge's comparisons get counted.
+*/
+
+template <class Less>
+struct uncounted
+{
+    typedef Less type;
+};
+
+template <class Less>
+struct uncounted<counted_less<Less> >
+{
+    typedef Less type;
+};
+
+/*!
+    One pass of sort(), for the metrics it ends with.
+*/
+
+struct pass_meter
+{
+    unsigned long long ns;
+    unsigned long long compares;
+    tape_meter tapes[4];
+};
+
+/*!
+    A simulated tape: one contiguous buffer used as a ring, with a read
+    cursor ('head_') and a write cursor ('tail_').
+
+    Reads still consume what they return, but nothing is handed back to
+    the allocator: once a pass has drained the tape, rewind() puts both
+    cursors back at the start of the same buffer, so the next pass
+    streams linearly through memory that's already there.  The buffer
+    only grows if somebody writes more than was reserve()d.
+
+    put() also counts descents (places where a value is smaller than
+    the one written just before it) since the tape was last empty, so
+    whether a freshly written tape is in order is an O(1) question.
+
+    The values are records of type 'T', in the order 'Less' puts them.
+*/
+
+template <class T, class Less = std::less<T> >
+class tape_t
+{
+public:
+    tape_t() : buf_(16), head_(0), tail_(0), count_(0),
+               descents_(0), last_()
+    {
+        meter_.reads = meter_.writes = meter_.rewinds = 0;
+    }
+
+    const tape_meter &meter() const { return meter_; }
+
+    unsigned int size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+    // i'th element from the read cursor
+    T operator[](unsigned int i) const { return buf_[wrap(head_ + i)]; }
+    T front() const { return buf_[head_]; }
+    T back() const { return last_; }
 
-typedef std::deque<data_t> tape_t;
+    // only meaningful for a tape that hasn't been partly read since
+    // it was written
+    unsigned int descents() const { return count_ ? descents_ : 0; }
+
+    T get()
+    {
+        T d = buf_[head_];
+        head_ = wrap(head_ + 1);
+        --count_;
+        ++meter_.reads;
+        return d;
+    }
+
+    void put(T d)
+    {
+        if (count_ == buf_.size())
+            grow(2 * buf_.size());
+        if (!count_)
+            descents_ = 0;
+        else if (typename uncounted<Less>::type()(d, last_))
+            ++descents_;
+        last_ = d;
+        buf_[tail_] = d;
+        tail_ = wrap(tail_ + 1);
+        ++count_;
+        ++meter_.writes;
+    }
+
+    // O(1): a drained tape starts over at the front of its buffer
+    void rewind()
+    {
+        ++meter_.rewinds;
+        if (!count_)
+            head_ = tail_ = 0;
+    }
+
+    void clear() { head_ = tail_ = count_ = 0; }
+
+    void reserve(unsigned int capacity)
+    {
+        if (capacity > buf_.size())
+            grow(capacity);
+    }
+
+private:
+    // only ever asked to wrap indices < 2 * capacity
+    unsigned int wrap(unsigned int i) const
+    {
+        return i >= buf_.size() ? i - buf_.size() : i;
+    }
+
+    // Unrolls the ring into a bigger buffer, oldest element first.
+    void grow(unsigned int capacity)
+    {
+        std::vector<T> bigger(capacity);
+        for (unsigned int i = 0; i < count_; ++i)
+            bigger[i] = (*this)[i];
+        buf_.swap(bigger);
+        head_ = 0;
+        tail_ = count_ == buf_.size() ? 0 : count_;
+    }
+
+    std::vector<T> buf_;
+    unsigned int head_;
+    unsigned int tail_;
+    unsigned int count_;
+    unsigned int descents_;
+    T last_;
+    tape_meter meter_;
+};
 
 unsigned int n;
 
@@ -15,24 +199,40 @@ unsigned int n;
 // Prototypes
 ////////////////////////////////////////////////////////////////////////////////
 
-bool is_full(tape_t *t);
-bool is_end(tape_t *t1);
-int read(tape_t *t1, tape_t *t2, data_t *d);
-void write(data_t data, tape_t *t1, tape_t *t2);
-void rewind(tape_t *tape);
-bool is_sorted (tape_t *t1, tape_t *t2);
-void sort_3(data_t *a, data_t *b, data_t *c);
-
-void print(tape_t *t1, tape_t *t2);
-void print_all(data_t x,
-               data_t y,
-               data_t z,
-               tape_t *s1,
-               tape_t *s2,
-               tape_t *d1,
-               tape_t *d2);
-
-void sort(tape_t *t1, tape_t *t2, tape_t *t3, tape_t *t4);
+template <class T, class Less>
+bool is_full(tape_t<T, Less> *t);
+template <class T, class Less>
+bool is_end(tape_t<T, Less> *t1);
+template <class T, class Less>
+int read(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T *d);
+template <class T, class Less>
+void write(T data, tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void rewind(tape_t<T, Less> *tape);
+template <class T, class Less>
+bool is_sorted (tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void sort_3(T *a, T *b, T *c);
+
+template <class T, class Less>
+void print(tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void print_all(T x,
+               T y,
+               T z,
+               tape_t<T, Less> *s1,
+               tape_t<T, Less> *s2,
+               tape_t<T, Less> *d1,
+               tape_t<T, Less> *d2);
+
+template <class T>
+void print_metrics(const std::vector<pass_meter> &passes);
+
+template <class T, class Less>
+void sort(tape_t<T, Less> *t1,
+          tape_t<T, Less> *t2,
+          tape_t<T, Less> *t3,
+          tape_t<T, Less> *t4);
 
 
 
@@ -52,8 +252,9 @@ void sort(tape_t *t1, tape_t *t2, tape_t *t3, tape_t *t4);
 
 */
 
+template <class T, class Less>
 bool
-is_full(tape_t *t)
+is_full(tape_t<T, Less> *t)
 {
     return t->size() == n / 2;
 }
@@ -67,32 +268,33 @@ is_full(tape_t *t)
     I stuck the 'b' sense in is_full().
 */
 
+template <class T, class Less>
 bool
-is_end(tape_t *t)
+is_end(tape_t<T, Less> *t)
 {
     return t->empty();
 }
 
 /*!
-    For my simulated tape a read is destructive: for a deque it's
-    annoying to write over previous values.  The ultimate behavior is
-    the same as you'd get with the tape in the problem.
+    For my simulated tape a read is destructive: the read cursor moves
+    past whatever it hands back, and it's only reused once the tape has
+    been drained and rewound.  The ultimate behavior is the same as
+    you'd get with the tape in the problem.
 */
 
+template <class T, class Less>
 int
-read(tape_t *t1, tape_t *t2, data_t *d)
+read(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T *d)
 {
     int got_data = 0;
 
     if (!is_end(t1))
     {
-        *d = t1->front();
-        t1->pop_front();
+        *d = t1->get();
         got_data = 1;
     } else if (!is_end(t2))
     {
-        *d = t2->front();
-        t2->pop_front();
+        *d = t2->get();
         got_data = 1;
     }
     return got_data;
@@ -103,58 +305,49 @@ read(tape_t *t1, tape_t *t2, data_t *d)
     longer tape of size 'n'.  Having both tapes full makes us 'splode.
 */
 
+template <class T, class Less>
 void
-write(tape_t *t1, tape_t *t2, data_t data)
+write(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T data)
 {
     assert((is_full(t1) && is_full(t2)) || "both tapes full");
 
     if (!is_full(t1))
-        t1->push_back(data);
+        t1->put(data);
     else
-        t2->push_back(data);
+        t2->put(data);
 }
 
 /*!
-    There's nothing to do here, since I'm only modeling the tape.
-    This is just so you can see where a rewind would be placed.
-
-    The goober code is so that I don't get a warning about an unused
-    variable.
+    Puts the tape's cursors back at the start of its buffer once it
+    has been read through, so the next pass reuses the same memory.
 
     Uhm, I consider rewind()s to be O(c).
 */
 
+template <class T, class Less>
 void
-rewind(tape_t *tape)
+rewind(tape_t<T, Less> *tape)
 {
-    if (!tape)
-        cout << "Poopers\n";
+    tape->rewind();
 }
 
 /*!
-    This is O(n).
+    This is O(c): the tapes kept count of their own descents as they
+    were written, so all that's left is the seam between t1 and t2.
 */
 
+template <class T, class Less>
 bool
-is_sorted (tape_t *t1, tape_t *t2)
+is_sorted (tape_t<T, Less> *t1, tape_t<T, Less> *t2)
 {
-    rewind(t1);
-    rewind(t2);
+    if (t1->descents() || t2->descents())
+        return false;
 
-    std::vector<data_t> v;
-    v.insert(v.end(), t1->begin(), t1->end());
-    v.insert(v.end(), t2->begin(), t2->end());
+    if (t1->empty() || t2->empty())
+        return true;
 
-    data_t monotonic = v[0];
-    unsigned int size = v.size();
-    for (unsigned i = 1; i < size; ++i)
-    {
-        if (v[i] >= monotonic)  // not strictly monotonic: can have multiple
-            monotonic = v[i];
-        else
-            return false;
-    }
-    return true;
+    // not strictly monotonic: can have several of the same value
+    return !typename uncounted<Less>::type()(t2->front(), t1->back());
 }
 
 /*!
@@ -162,20 +355,22 @@ is_sorted (tape_t *t1, tape_t *t2)
     'a', etc.
 */
 
+template <class T, class Less>
 void
-sort_3(data_t *a, data_t *b, data_t *c)
+sort_3(T *a, T *b, T *c)
 {
-    data_t x = *a;
-    data_t y = *b;
-    data_t z = *c;
+    T x = *a;
+    T y = *b;
+    T z = *c;
 
-    if (z < y)
+    const Less less;
+    if (less(z, y))
         std::swap(y,z);
 
-    if (y < x)
+    if (less(y, x))
         std::swap(y,x);
 
-    if (z < y)
+    if (less(z, y))
         std::swap(z, y);
 
     *a = x;
@@ -183,17 +378,17 @@ sort_3(data_t *a, data_t *b, data_t *c)
     *c = z;
 }
 
+template <class T, class Less>
 void
-print(tape_t *t1, tape_t *t2)
+print(tape_t<T, Less> *t1, tape_t<T, Less> *t2)
 {
     if (t1->empty())
         cout << "empty ";
     else
     {
-        tape_t::const_iterator i = t1->begin();
-        const tape_t::const_iterator e = t1->end();
-        for ( ; i != e; ++i)
-            cout << *i << " ";
+        const unsigned int size = t1->size();
+        for (unsigned int i = 0; i < size; ++i)
+            cout << (*t1)[i] << " ";
     }
 
     cout << " | ";
@@ -202,23 +397,23 @@ print(tape_t *t1, tape_t *t2)
         cout << "empty";
     else
     {
-        tape_t::const_iterator i = t2->begin();
-        const tape_t::const_iterator e = t2->end();
-        for ( ; i != e; ++i)
-            cout << *i << " ";
+        const unsigned int size = t2->size();
+        for (unsigned int i = 0; i < size; ++i)
+            cout << (*t2)[i] << " ";
     }
 }
 
+template <class T, class Less>
 void
 print_all
 (
-    data_t x,
-    data_t y,
-    data_t z,
-    tape_t *s1,
-    tape_t *s2,
-    tape_t *d1,
-    tape_t *d2
+    T x,
+    T y,
+    T z,
+    tape_t<T, Less> *s1,
+    tape_t<T, Less> *s2,
+    tape_t<T, Less> *d1,
+    tape_t<T, Less> *d2
 )
 {
     cout << "x " << x << " y " << y << " z " << z << "\t\t";
@@ -229,27 +424,59 @@ print_all
 }
 
 
+/*!
+    The passes as JSON, on one line: comparisons, nanoseconds, and for
+    each of t1..t4 what was read, written and rewound, and the bytes
+    that makes.
+*/
+
+template <class T>
+void
+print_metrics(const std::vector<pass_meter> &passes)
+{
+    cout << "Metrics: { \"n\": " << n << ", \"passes\": [";
+    for (unsigned int i = 0; i < passes.size(); ++i)
+    {
+        const pass_meter &p = passes[i];
+        cout << (i ? ", " : " ") << "{ \"pass\": " << i
+             << ", \"ns\": " << p.ns
+             << ", \"comparisons\": " << p.compares << ", \"tapes\": [";
+        for (unsigned int j = 0; j < 4; ++j)
+        {
+            const tape_meter &t = p.tapes[j];
+            cout << (j ? ", " : " ") << "{ \"reads\": " << t.reads
+                 << ", \"writes\": " << t.writes
+                 << ", \"rewinds\": " << t.rewinds
+                 << ", \"bytes\": " << (t.reads + t.writes) * sizeof(T)
+                 << " }";
+        }
+        cout << " ] }";
+    }
+    cout << " ] }\n";
+}
+
 /*!
     Does the real work.
 */
 
+template <class T, class Less>
 void
 sort
 (
-    tape_t *t1,
-    tape_t *t2,
-    tape_t *t3,
-    tape_t *t4
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
 )
 {
-    tape_t *source1 = t1;
-    tape_t *source2 = t2;
-    tape_t *dest1 = t3;
-    tape_t *dest2 = t4;
+    tape_t<T, Less> *source1 = t1;
+    tape_t<T, Less> *source2 = t2;
+    tape_t<T, Less> *dest1 = t3;
+    tape_t<T, Less> *dest2 = t4;
 
-    unsigned int x, y, z;
+    T x, y, z;
     unsigned int count = 17;    // whatever, as long as > 3
-    x = y = z = 0;
+    x = y = z = T();
 
     // small "hand-coded" sorts for n <= 3
     if (n < 4)
@@ -274,7 +501,7 @@ sort
         return;
 
     case 2:
-        if (x < y)
+        if (Less()(x, y))
         {
             write(dest1, dest2, x);
             write(dest1, dest2, y);
@@ -288,46 +515,55 @@ sort
         return;
 
     case 3:
-        sort_3(&x, &y, &z);
+        sort_3<T, Less>(&x, &y, &z);
         write(dest1, dest2, x);
         write(dest1, dest2, y);
         write(dest1, dest2, z);
         return;
     }
 
-    print_all(x, y, z, source1, source2, dest1, dest2);
+    TRACE(1, print_all(x, y, z, source1, source2, dest1, dest2));
 
     // "big" routine needs tweaking for odd numbers: n / 2 not so good.
 
+    tape_t<T, Less> *tapes[4] = { t1, t2, t3, t4 };
+    std::vector<pass_meter> passes;
+
     while (!is_sorted(source1, source2))
     {
+        pass_meter pass;
+        for (unsigned int i = 0; i < 4; ++i)
+            pass.tapes[i] = tapes[i]->meter();
+        pass.compares = compared;
+        const std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+
         count = 0;
         read(source1, source2, &x);
         read(source1, source2, &y);
         read(source1, source2, &z);
-        sort_3(&x, &y, &z);
-
- //     print_all(x, y, z, source1, source2, dest1, dest2);
+        sort_3<T, Less>(&x, &y, &z);
+        TRACE(2, print_all(x, y, z, source1, source2, dest1, dest2));
 
         // x < y < z
         write(dest1, dest2, x);
-//      print_all(x, y, z, source1, source2, dest1, dest2);
+        TRACE(2, print_all(x, y, z, source1, source2, dest1, dest2));
 
         // read until source tapes are empty, always writing smallest
         // value into destination tapes
         while (read(source1, source2, &x))
         {
             // puts smallest of x, y, z into x
-            sort_3(&x, &y, &z);
-//          print_all(x, y, z, source1, source2, dest1, dest2);
+            sort_3<T, Less>(&x, &y, &z);
+            TRACE(2, print_all(x, y, z, source1, source2, dest1, dest2));
             write(dest1, dest2, x);
-//          print_all(x, y, z, source1, source2, dest1, dest2);
+            TRACE(2, print_all(x, y, z, source1, source2, dest1, dest2));
         }
         // two values remain: in 'y' and 'z', with y < z: write them out.
         write(dest1, dest2, y);
         write(dest1, dest2, z);
 
-        print_all(x, y, z, source1, source2, dest1, dest2);
+        TRACE(1, print_all(x, y, z, source1, source2, dest1, dest2));
 
         // source tapes are empty: switch source and dest pointers
         std::swap(source1, dest1);
@@ -338,31 +574,46 @@ sort
         rewind(source2);
         rewind(dest1);
         rewind(dest2);
+
+        pass.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        pass.compares = compared - pass.compares;
+        for (unsigned int i = 0; i < 4; ++i)
+        {
+            const tape_meter &now = tapes[i]->meter();
+            pass.tapes[i].reads = now.reads - pass.tapes[i].reads;
+            pass.tapes[i].writes = now.writes - pass.tapes[i].writes;
+            pass.tapes[i].rewinds = now.rewinds - pass.tapes[i].rewinds;
+        }
+        passes.push_back(pass);
     }
 
     cout << "\n\nSorted list:    ";
     print(source1, source2);
     cout << "\n\n\n";
+    print_metrics<T>(passes);
 }
 
 int
 main(int argc, char *argv[])
 {
-    tape_t t1;
-    tape_t t2;
-    tape_t t3;
-    tape_t t4;
+    // comparisons counted, for the metrics
+    typedef counted_less<std::less<data_t> > less_t;
+    tape_t<data_t, less_t> t1;
+    tape_t<data_t, less_t> t2;
+    tape_t<data_t, less_t> t3;
+    tape_t<data_t, less_t> t4;
 
     // fill the tape
     n = 8;
-    write(&t1, &t2, 1);
-    write(&t1, &t2, 19);
-    write(&t1, &t2, 17);
-    write(&t1, &t2, 3);
-    write(&t1, &t2, 56);
-    write(&t1, &t2, 42);
-    write(&t1, &t2, 5);
-    write(&t1, &t2, 18);
+    write<data_t>(&t1, &t2, 1);
+    write<data_t>(&t1, &t2, 19);
+    write<data_t>(&t1, &t2, 17);
+    write<data_t>(&t1, &t2, 3);
+    write<data_t>(&t1, &t2, 56);
+    write<data_t>(&t1, &t2, 42);
+    write<data_t>(&t1, &t2, 5);
+    write<data_t>(&t1, &t2, 18);
 
     sort(&t1, &t2, &t3, &t4);
     return 0;
@@ -1,484 +1,6207 @@
 #include <iostream>
 using std::cout;
+#include <fstream>
+#include <sstream>                      // trace entries, for '-T'
 #include <deque>
 #include <vector>
-#include <utility>                      // std::swap()
+#include <utility>                      // std::swap(), std::pair
+#include <algorithm>                    // std::push_heap(), std::pop_heap()
+#include <functional>                   // std::greater
 
-#include <assert.h>                     // assert()
-#include <stdlib.h>                     // drand48(), atoi()
-
-typedef unsigned int data_t;
-typedef std::vector<data_t> v_data_t;
-typedef std::deque<data_t> tape_t;
-
-namespace
-{
-    unsigned int n;                     // global
-
-    enum
-    {
-        HAIL_ERIS   = 17,
-        ITERATIONS  = 1,
-        MAX_N       = 42,
-        MAX_VALUE   = 169
-    };
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>                       // std::chrono::steady_clock
+#include <random>                       // std::mt19937, for '-B'
+#include <type_traits>                  // std::is_trivially_copyable
+#include <limits>                       // std::numeric_limits
 
-    enum test_type { MANUAL, AUTOMATIC };
+#include <assert.h>                     // assert()
+#include <ctype.h>                      // isspace()
+#include <errno.h>
+#include <fcntl.h>                      // open(), for '-i' and '-o'
+#include <signal.h>                     // signal(), for '-T'
+#include <stdlib.h>                     // drand48(), atoi(), mkstemp()
+#include <stdint.h>                     // uint64_t
+#include <string.h>                     // strcmp(), strerror(), memcpy()
+#include <sys/mman.h>                   // mmap(), mremap(), madvise()
+#include <sys/stat.h>                   // fstat(), for '-o'
+#include <unistd.h>                     // getopt(), pread(), pwrite()
 
-    #define RAND(a,b) static_cast<a>(drand48() * (b))
-}
+/*
+    How much tracing gets compiled in: 0 none at all, 1 the tapes at
+    the start and end of a pass, 2 the tapes every time the classic
+    engine moves a value (which makes it O(n^2)).  Builds with NDEBUG
+    leave it out unless told otherwise.  A trace site whose level is
+    above TRACE_LEVEL is dead code: it still has to compile, but none
+    of it makes it into the program.
+*/
 
-////////////////////////////////////////////////////////////////////////////////
-// Prototypes
-////////////////////////////////////////////////////////////////////////////////
+#ifndef TRACE_LEVEL
+#ifdef NDEBUG
+#define TRACE_LEVEL 0
+#else
+#define TRACE_LEVEL 1
+#endif
+#endif
 
-bool is_full(tape_t *t);
-bool is_end(tape_t *t1);
-bool read(tape_t *t, data_t *d);
-int read(tape_t *t1, tape_t *t2, data_t *d);
-void write(tape_t *t, data_t data);
-void write(data_t data, tape_t *t1, tape_t *t2);
-void rewind(tape_t *tape);
-bool is_sorted (tape_t *t1, tape_t *t2);
-
-void print_single(tape_t *t);
-void print(tape_t *t1, tape_t *t2);
-void print_all(data_t x,
-               data_t y,
-               tape_t *s1,
-               tape_t *s2,
-               tape_t *d1,
-               tape_t *d2);
-
-bool write_data(tape_t **to_write,
-                tape_t *d1,
-                tape_t *d2,
-                tape_t *source,
-                data_t *data,
-                bool cross);
+#define TRACE(level, call) \
+    do { if (TRACE_LEVEL >= (level)) call; } while (0)
 
-void sort(tape_t *t1, tape_t *t2, tape_t *t3, tape_t *t4);
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>                  // SSE4.1 and AVX2 intrinsics
+#endif
 
+typedef unsigned int data_t;            // the default record
 
+template <class T>
+using run_key_t = std::pair<unsigned int, T>;          // (run #, value)
 
+/*!
+    std::greater for run_key_t, with the values compared by 'Less'.
+*/
 
-////////////////////////////////////////////////////////////////////////////////
-// Definitions
-////////////////////////////////////////////////////////////////////////////////
+template <class T, class Less>
+struct run_key_greater
+{
+    bool operator()(const run_key_t<T> &x, const run_key_t<T> &y) const
+    {
+        if (x.first != y.first)
+            return x.first > y.first;
+        return Less()(y.second, x.second);
+    }
+};
 
 /*!
-    Might have to jiggle if 'n' is odd.
+    A block merge kernel: merges sorted a[0..la) and b[0..lb) into 'out'
+    (which has 'room' values of space) for as long as it can work whole
+    vectors at a time.  Sets *ia and *ib to how much of each it used up
+    and returns how many values it wrote, which may be none.  Kernels
+    only come for plain data_t: see vector_merge().
+*/
 
-    Returns true if tape is full.
+typedef unsigned int (*merge_kernel_t)(const data_t *a,
+                                       unsigned int la,
+                                       const data_t *b,
+                                       unsigned int lb,
+                                       data_t *out,
+                                       unsigned int room,
+                                       unsigned int *ia,
+                                       unsigned int *ib);
 
-    is_full() and is_end() together form the proper IsEnd() of the
-    problem.  It's just clearer to me for the simulated tape to have
-    two routines.
+// Told when make_runs() finishes a run: which destination it went on
+// (0 or 1) and how long it was.
+typedef std::function<void (unsigned int, unsigned int)> run_hook_t;
 
+/*!
+    What a tape has done since it was made, for '-M': values read off
+    it, values written onto it, and rewinds.  Every meter there is sits
+    on 'all', so a pass can be measured without the engine having to
+    say which tapes it used.  Tapes come and go on the main thread only.
 */
 
-bool
-is_full(tape_t *t)
+struct tape_meter
 {
-    return t->size() == n / 2;
-}
+    explicit tape_meter(unsigned int size);
+    ~tape_meter();
 
-/*!
-    You're at the end of the tape if:
+    unsigned int id;                    // tapes numbered as they're made
+    unsigned int size;                  // bytes a record
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long rewinds;
 
-        a) Read all data off tape
-        b) Written tape until it's full
+    static std::vector<tape_meter *> all;
 
-    I stuck the 'b' sense in is_full().
+private:
+    tape_meter(const tape_meter &);
+    tape_meter &operator=(const tape_meter &);
+};
+
+/*!
+    'Less', counting how often it gets asked.  The count is one for
+    every thread there is, and costs them a locked add each time, so
+    it only gets plugged in for '-M': see main().
 */
 
-bool
-is_end(tape_t *t)
+struct compare_count
 {
-    return t->empty();
-}
+    static std::atomic<unsigned long long> asked;
+};
 
-bool
-read(tape_t *t, data_t *d)
+template <class Less>
+struct counted_less : compare_count
 {
-    bool got_data = false;
-    if (!is_end(t))
+    template <class T>
+    bool operator()(const T &a, const T &b) const
     {
-        *d = t->front();
-        t->pop_front();
-        got_data = true;
+        asked.fetch_add(1, std::memory_order_relaxed);
+        return Less()(a, b);
     }
-    return got_data;
-}
+};
 
 /*!
-    For my simulated tape a read is destructive: for a deque it's
-    annoying to write over previous values.  The ultimate behavior is
-    the same as you'd get with the tape in the problem.
+    'Less' with the counting taken off, for the comparisons that only
+    keep the books (a tape's descents, where runs end, whether it's all
+    sorted already): '-M' counts the ones that decide what goes first.
 */
 
-int
-read(tape_t *t1, tape_t *t2, data_t *d)
+template <class Less>
+struct uncounted
 {
-    int got_data = 0;
-
-    if (!is_end(t1))
-    {
-        *d = t1->front();
-        t1->pop_front();
-        got_data = 1;
-    } else if (!is_end(t2))
-    {
-        *d = t2->front();
-        t2->pop_front();
-        got_data = 1;
-    }
-    return got_data;
-}
+    typedef Less type;
+};
 
-void
-write(tape_t *t, data_t data)
+template <class Less>
+struct uncounted<counted_less<Less> >
 {
-    assert(t && !is_full(t));
-    t->push_back(data);
-}
+    typedef Less type;
+};
+
+template <class Less>
+using plain_t = typename uncounted<Less>::type;
 
 /*!
-    Put value 'data' on one of t1 or t2: treat them as a single,
-    longer tape of size 'n'.  Having both tapes full makes us 'splode.
+    Where memory tapes keep their rings: slices of a few big anonymous
+    mappings, handed out front to back.  A mapping only gets its space
+    back once every slice of it has come back, and then the newest one
+    starts over from the front, so tapes sized the same as last time
+    map nothing new.  expect() says how much the next few slices add up
+    to, so they can all come out of one mapping.
+
+    With '-H' the mappings are huge pages: reserved ones (MAP_HUGETLB)
+    if the system has any set aside, transparent ones (MADV_HUGEPAGE)
+    if not.  Tapes come and go on the main thread only.
 */
 
-void
-write(tape_t *t1, tape_t *t2, data_t data)
+class tape_arena
 {
-    assert(!is_full(t1) || !is_full(t2));
+public:
+    tape_arena() { }
+    ~tape_arena();
 
-    if (!is_full(t1))
-        t1->push_back(data);
-    else
-        t2->push_back(data);
-}
+    void expect(size_t bytes);
+    void *take(size_t bytes);
+    void give(void *slice);
 
-/*!
-    There's nothing to do here, since I'm only modeling the tape.
-    This is just so you can see where a rewind would be placed.
+    // what a slice of 'bytes' really takes: each starts on a cache line
+    static size_t round(size_t bytes) { return (bytes + 63) & ~size_t(63); }
 
-    The goober code is so that I don't get a warning about an unused
-    variable.
+private:
+    tape_arena(const tape_arena &);
+    tape_arena &operator=(const tape_arena &);
 
-    Uhm, I consider rewind()s to be O(c).
-*/
+    struct region
+    {
+        char *base;
+        size_t size;
+        size_t used;                    // handed out, from the front
+        unsigned int slices;            // ... and not given back yet
+    };
 
-void
-rewind(tape_t *tape)
-{
-    if (!tape)
-        cout << "Poopers\n";
-}
+    bool room(size_t bytes) const;
+    void map(size_t bytes);
+
+    std::vector<region> regions_;       // the newest last
+};
 
 /*!
-    This is O(n).
+    A simulated tape: one contiguous buffer used as a ring, with a read
+    cursor ('head_') and a write cursor ('tail_').
+
+    Reads still consume what they return, but nothing is handed back to
+    the allocator: once a pass has drained the tape, rewind() puts both
+    cursors back at the start of the same buffer, so the next pass
+    streams linearly through memory that's already there.  The buffer
+    only grows if somebody writes more than was reserve()d.
+
+    put() also counts descents (places where a value is smaller than
+    the one written just before it) since the tape was last empty, so
+    whether a freshly written tape is in order is an O(1) question.
+
+    After attach() the tape lives in a file instead, and the ring shrinks
+    to 'depth' blocks of BLOCK values, with a thread of its own doing the
+    file I/O.  Writing, each block that fills up is queued for that
+    thread to write behind while put() carries on into the next one;
+    reading, the thread keeps every block but the one get() is using
+    filled ahead of it.  get() and put() only wait when they catch up
+    with the thread, so the merge and the disk overlap, and a tape never
+    has more than 'depth' blocks in flight.
+
+    rewind() is a real rewind then: it flushes whatever is still
+    buffered and starts reading from the top of the file.  Like the real
+    thing, a file tape has to be rewound between writing it and reading
+    it back, and between reading it dry and writing it again.
+
+    get() and put() pay for the bookkeeping on every value.  The hot
+    loops use spans instead: read_span() hands out the values that can
+    be read straight out of the buffer and skip() consumes them;
+    write_span() hands out the room that can be written straight into
+    and commit() adds it to the tape.  The checks happen once a span.
+
+    attach(dir, true) maps the file instead: the mapping is the ring, so
+    the tape works just like the in-memory one (no blocks, no copies
+    through a buffer) and the kernel, told with madvise() that access is
+    sequential, does the reading ahead and writing behind.  It grows by
+    stretching the file and remapping.
+
+    A tape holds records of type 'T', in the order 'Less' puts them
+    (a default constructed one gets asked every time).  File tapes move
+    records as raw bytes, so they're for trivially copyable records only.
+    So is the tape_arena: a memory tape of those gets its ring there once
+    it outgrows the few values it starts with, and any other kind keeps
+    its ring in a vector, where the records get copied properly.
+
+    meter() is what the tape has been through, counted a span at a time
+    where the tape works a span at a time: see tape_meter.
 */
 
-bool
-is_sorted (tape_t *t1, tape_t *t2)
+template <class T, class Less = std::less<T> >
+class tape_t
 {
-    rewind(t1);
-    rewind(t2);
+public:
+    static const unsigned int BLOCK = 1 << 16;  // values per file block
+
+    tape_t() : mem_(16), buf_(&mem_[0]), lent_(false), cap_(16),
+               head_(0), tail_(0), count_(0), descents_(0), last_(),
+               fd_(-1), mapped_(false),
+               rpos_(0), wpos_(0), pending_(0), reading_(false),
+               get_mark_(~0u), put_mark_(~0u), stop_(false),
+               meter_(sizeof(T))
+    { }
+
+    ~tape_t();
+
+    const tape_meter &meter() const { return meter_; }
 
-    v_data_t v;
-    v.insert(v.end(), t1->begin(), t1->end());
-    v.insert(v.end(), t2->begin(), t2->end());
+    void attach(const char *dir, bool mapped, unsigned int depth);
 
-    data_t monotonic = v[0];
-    unsigned int size = v.size();
-    for (unsigned i = 1; i < size; ++i)
+    unsigned int size() const { return count_ + pending_ + wpos_ - rpos_; }
+    bool empty() const { return size() == 0; }
+
+    // i'th element from the read cursor, or 'max' of them from there
+    // on; for printing, not for merging
+    T at(unsigned int i);
+    unsigned int peek(unsigned int i, T *d, unsigned int max);
+    T front() const { return buf_[head_]; }
+    T back() const { return last_; }
+
+    // only meaningful for a tape that hasn't been partly read since
+    // it was written
+    unsigned int descents() const { return empty() ? 0 : descents_; }
+
+    T get()
     {
-        if (v[i] >= monotonic)  // not strictly monotonic: can have
-            monotonic = v[i];   // several of the same value
-        else
-            return false;
+        T d = buf_[head_];
+        head_ = wrap(head_ + 1);
+        --count_;
+        ++meter_.reads;
+        if (head_ == get_mark_)
+            next_block();               // buffered file tapes only
+        return d;
     }
-    return true;
-}
 
-/*!
-    Contents of a single tape.
-*/
+    void put(T d)
+    {
+        if (count_ == cap_)
+            grow(2 * cap_);             // memory and mapped tapes only
+        if (empty())
+            descents_ = 0;
+        else if (plain_t<Less>()(d, last_))
+            ++descents_;
+        last_ = d;
+        buf_[tail_] = d;
+        tail_ = wrap(tail_ + 1);
+        ++count_;
+        ++meter_.writes;
+        if (tail_ == put_mark_)
+            flush_block();              // buffered file tapes only
+    }
 
-void
-print_single(tape_t *t)
-{
-    if (t->empty())
-        cout << "empty ";
-    else
+    // Values from the read cursor on that sit together in the buffer:
+    // at least one, unless the tape is empty.
+    const T *read_span(unsigned int *length) const
     {
-        tape_t::const_iterator i = t->begin();
-        const tape_t::const_iterator e = t->end();
-        for ( ; i != e; ++i)
-            cout << *i << " ";
+        *length = std::min(count_, cap_ - head_);
+        return buf_ + head_;
     }
 
-}
+    void skip(unsigned int k)
+    {
+        head_ = wrap(head_ + k);
+        count_ -= k;
+        meter_.reads += k;
+        if (head_ == get_mark_)
+            next_block();
+    }
 
-void
-print(tape_t *t1, tape_t *t2)
-{
-    print_single(t1);
-    cout << " | ";
-    print_single(t2);
-}
+    // Room after the write cursor that can be filled in place: at
+    // least one value's worth.
+    T *write_span(unsigned int *room)
+    {
+        if (count_ == cap_)
+            grow(2 * cap_);
+        unsigned int r = std::min(cap_ - count_, cap_ - tail_);
+        if (put_mark_ != ~0u)
+            r = std::min(r, (put_mark_ ? put_mark_ : cap_) - tail_);
+        *room = r;
+        return buf_ + tail_;
+    }
 
-void
-print_all
-(
-    data_t x,
-    data_t y,
-    tape_t *s1,
-    tape_t *s2,
-    tape_t *d1,
-    tape_t *d2
-)
-{
-    cout << "\nx: " << x << " y: " << y << "\n";
-    print(s1, s2);
-    cout << "\t\t";
-    print(d1, d2);
-    cout << "\n";
-}
+    // The first 'k' values of the last write_span() are on the tape.
+    void commit(unsigned int k)
+    {
+        if (!k)
+            return;
+        const T *d = buf_ + tail_;
+        unsigned int i = 0;
+        if (empty())
+        {
+            descents_ = 0;
+            last_ = d[0];
+            i = 1;
+        }
+        for ( ; i < k; ++i)
+        {
+            descents_ += plain_t<Less>()(d[i], last_);
+            last_ = d[i];
+        }
+        tail_ = wrap(tail_ + k);
+        count_ += k;
+        meter_.writes += k;
+        if (tail_ == put_mark_)
+            flush_block();
+    }
 
+    // O(1) in memory: a drained tape starts over at the front of its
+    // buffer.  See above for buffered file tapes.
+    void rewind()
+    {
+        ++meter_.rewinds;
+        if (buffered())
+            rewind_file();
+        else if (!count_)
+            head_ = tail_ = 0;
+    }
 
-bool
-write_data
-(
-    tape_t **to_write,
-    tape_t *d1,
-    tape_t *d2,
-    tape_t *source,
-    tape_t *alternate,
-    data_t *data,
-    bool cross
-)
-{
-    assert(to_write);
-    assert(*to_write);
-    assert(d1);
-    assert(d2);
-    assert(source);
-    assert(data);
+    void clear();
 
-    data_t d = *data;
-    bool got_data = false;
+    void reserve(unsigned int capacity)
+    {
+        if (!buffered() && capacity > cap_)
+            grow(capacity);
+    }
 
-    if (cross)
+    // What reserve(capacity) would take from the arena.
+    size_t wants(unsigned int capacity) const
     {
-        // if on 'cross', smallest value goes on opposite of last tape
-        // we wrote to
-        write(*to_write, d);
+        if (fd_ >= 0 || capacity <= cap_ ||
+            !std::is_trivially_copyable<T>::value)
+            return 0;
+        return tape_arena::round(size_t(capacity) * sizeof(T));
+    }
 
-        // Here is what switches destination tapes
-        *to_write = ((*to_write) == d1 ? d2 : d1);
-        // Need a new value: read next element from tape
-        got_data = read(source, data);
-        if (!got_data)
-        {
-            got_data = read(alternate, &d);
-            while (got_data)
-            {
-                write(d1, d2, d);
-                got_data = read(alternate, &d);
-            }
-        }
-    } else
+    // Memory and mapped tapes can hand out their whole buffer, for
+    // merging several runs at a time on different threads.
+    bool random_access() const { return !buffered(); }
+    T *buffer(unsigned int capacity);
+    void hold(unsigned int count);
+
+private:
+    tape_t(const tape_t &);             // one tape, one file
+    tape_t &operator=(const tape_t &);
+
+    // only ever asked to wrap indices < 2 * capacity
+    unsigned int wrap(unsigned int i) const
     {
-        // else just write linearly along tape
-        write(d1, d2, d);
-        // Need a new x: read next element from tape where
-        // we got x: this is source1
-        got_data = read(source, data);
-        if (!got_data)
-        {
-            got_data = read(alternate, &d);
-            while (got_data)
-            {
-                write(d1, d2, d);
-                got_data = read(alternate, &d);
-            }
-        }
+        return i >= cap_ ? i - cap_ : i;
     }
-    return got_data;
-}
+
+    bool buffered() const { return fd_ >= 0 && !mapped_; }
+
+    void grow(unsigned int capacity);
+    void map(unsigned int capacity);
+
+    void next_block();
+    void flush_block();
+    void rewind_file();
+    void submit(unsigned int block, unsigned int length, bool write);
+    void wait(unsigned int block);
+    void io_loop();
+
+    std::vector<T> mem_;                // backs buf_ unless it's mapped
+    T *buf_;                            // ... or lent by the arena
+    bool lent_;
+    unsigned int cap_;
+    unsigned int head_;
+    unsigned int tail_;
+    unsigned int count_;                // values in buf_
+    unsigned int descents_;
+    T last_;
+
+    // file tapes only
+    int fd_;
+    bool mapped_;
+
+    // buffered file tapes only
+    unsigned int rpos_;                 // file offsets, in values
+    unsigned int wpos_;
+    unsigned int pending_;              // values on their way into buf_
+    bool reading_;
+    unsigned int get_mark_;             // where head_/tail_ cross into
+    unsigned int put_mark_;             // the next block of buf_
+
+    struct block_io
+    {
+        off_t offset;                   // in bytes
+        unsigned int length;            // in values
+        bool write;
+        bool busy;                      // submitted, not yet waited for
+        bool done;                      // the I/O thread is finished
+        int error;
+    };
+
+    std::vector<block_io> io_;          // one per block of buf_
+    std::deque<unsigned int> queue_;    // blocks for the I/O thread
+    std::mutex lock_;                   // guards queue_, stop_, 'done'
+    std::condition_variable work_;      // queue_ has something
+    std::condition_variable finished_;  // some block is done
+    bool stop_;
+    std::thread thread_;
+
+    tape_meter meter_;
+};
 
 /*!
-    Does the real work.
+    Tournament ("loser") tree over 'ways' inputs.  Each internal node
+    remembers the input that lost the match played there; the overall
+    winner sits in node 0.  When the winner's key changes, only the
+    matches on its own path back to the root get replayed, so picking
+    the next value costs log2(ways) comparisons whatever 'ways' is.
+
+    An input that is 'done' (its run is over, or the tape is empty)
+    loses to everybody.  Ties go to the lower numbered input.
 */
 
-void
-sort
-(
-    tape_t *t1,
-    tape_t *t2,
-    tape_t *t3,
-    tape_t *t4
-)
+template <class T, class Less>
+class loser_tree
 {
-    tape_t *source1 = t1;
-    tape_t *source2 = t2;
-    tape_t *dest1 = t3;
-    tape_t *dest2 = t4;
-    tape_t *to_write = t3;
+public:
+    explicit loser_tree(unsigned int ways)
+        : node_(ways), key_(ways), done_(ways)
+    { }
 
-    unsigned int x, y;
-    unsigned int count = 17;    // whatever, as long as > 3
-    bool cross = true, got_data = false;
-    x = y = 0;
+    unsigned int ways() const { return node_.size(); }
+    unsigned int winner() const { return node_[0]; }
+    bool finished() const { return done_[node_[0]]; }
 
-    // small "hand-coded" sorts for n < 3
-    if (n < 3)
+    void set(unsigned int i, T key, bool done)
     {
-        count = 0;
-        count += read(source1, source2, &x);
-        count += read(source1, source2, &y);
+        key_[i] = key;
+        done_[i] = done;
     }
 
-    switch (count)
+    // Plays every match from scratch: after set()ting all the inputs.
+    void build()
     {
-    case 0:
-        // no elements to sort
-        print(dest1, dest2);
-        return;
+        const unsigned int m = ways();
+        std::vector<unsigned int> won(m);
 
-    case 1:
-        // sorted already;
-        write(dest1, dest2, x);
-        print(dest1, dest2);
-        return;
+        if (m == 1)
+        {
+            node_[0] = 0;
+            return;
+        }
 
-    case 2:
-        print_all(x, y, source1, source2, dest1, dest2);
-        if (x < y)
+        // leaves are nodes m..2m-1, so the children of 'k' are 2k, 2k+1
+        for (unsigned int k = m - 1; k >= 1; --k)
         {
-            write(dest1, dest2, x);
-            write(dest1, dest2, y);
-        } else
+            unsigned int a = 2 * k >= m ? 2 * k - m : won[2 * k];
+            unsigned int b = 2 * k + 1 >= m ? 2 * k + 1 - m : won[2 * k + 1];
+            if (beats(b, a))
+                std::swap(a, b);
+            won[k] = a;
+            node_[k] = b;
+        }
+        node_[0] = won[1];
+    }
+
+    // Input 'i' (the last winner) has a new key: replay its matches.
+    void replay(unsigned int i, T key, bool done)
+    {
+        set(i, key, done);
+        for (unsigned int k = (i + ways()) / 2; k >= 1; k /= 2)
         {
-            write(dest1, dest2, y);
-            write(dest1, dest2, x);
+            if (beats(node_[k], i))
+                std::swap(node_[k], i);
         }
+        node_[0] = i;
+    }
 
-        print(dest1, dest2);
-        return;
+private:
+    bool beats(unsigned int a, unsigned int b) const
+    {
+        if (done_[a])
+            return false;
+        if (done_[b])
+            return true;
+        const Less less;
+        return less(key_[a], key_[b]) || (!less(key_[b], key_[a]) && a < b);
     }
 
-    print_all(x, y, source1, source2, dest1, dest2);
+    std::vector<unsigned int> node_;
+    std::vector<T> key_;
+    std::vector<bool> done_;
+};
 
-    // "big" routine needs tweaking for odd numbers: n / 2 not so good.
-    count = 0;
-    while (!is_sorted(source1, source2))
-    {
+/*!
+    A fixed set of threads with a work-stealing deque each.  spawn()
+    puts a task on the end of the calling thread's own deque, so a task
+    that spawns more keeps its own thread busy with them, most recent
+    first; a thread with nothing left steals the oldest task off
+    somebody else's.  wait() pitches in on the calling thread until
+    everything spawned so far, and everything that spawned, is done.
+
+    The thread that made the pool counts as worker 0, and so does any
+    thread that isn't one of the pool's own.
+*/
+
+class worker_pool
+{
+public:
+    typedef std::function<void ()> task_t;
+
+    explicit worker_pool(unsigned int threads);
+    ~worker_pool();
+
+    // including the thread that calls wait()
+    unsigned int size() const { return queues_.size(); }
+
+    void spawn(task_t task);
+    void wait();
+
+private:
+    worker_pool(const worker_pool &);
+    worker_pool &operator=(const worker_pool &);
+
+    struct task_queue
+    {
+        std::mutex lock;
+        std::deque<task_t> tasks;       // own end at the back
+    };
+
+    void work_loop(unsigned int self);
+    bool find(task_t *task);
+    void finish();
+
+    static thread_local unsigned int self_;
+
+    std::vector<task_queue> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<unsigned int> queued_;  // tasks sitting in queues_
+    std::atomic<unsigned int> pending_; // spawned, not finished yet
+    std::mutex lock_;                   // for sleeping on wake_
+    std::condition_variable wake_;      // more work, or all done
+    bool stop_;
+};
+
+/*!
+    One task of a merge_plan: whole run pairs, or a slice of one big
+    pair's output, to merge from one level's tapes onto the next.  It
+    can go once 'waiting' comes down to zero: the tasks that write its
+    input and the ones still reading where it writes count one each,
+    and the plan holds one more until it's done adding to the task.
+*/
+
+template <class T>
+struct merge_task
+{
+    struct pair_io
+    {
+        const T *a;
+        unsigned int la;
+        const T *b;
+        unsigned int lb;
+        T *out;                         // where the whole pair goes
+        unsigned int begin;             // the part of it this task does
+        unsigned int end;
+    };
+
+    std::vector<pair_io> pairs;
+    unsigned int size;                  // values, for batching
+    std::atomic<unsigned int> waiting;
+    std::vector<merge_task *> next;     // tasks waiting on this one
+    bool done;
+
+    merge_task() : size(0), waiting(1), done(false) { }
+};
+
+/*!
+    Natural merge sort as a graph of merge_tasks instead of a string of
+    passes.  Where a run pair goes, and what the runs on the next level
+    will be, follows from the lengths and the first and last values of
+    the runs alone: a merged pair starts with the smaller of the two
+    first values and ends with the bigger of the last.  So the plan can
+    lay out every pass as soon as it knows the runs it starts with,
+    without waiting for anything to be merged, and a task only waits
+    for what it really depends on: the tasks writing its two runs, and
+    the tasks still reading the part of the tape it's about to write
+    over.  Passes overlap, and there's no barrier between them.
+
+    The starting runs can come in a few at a time (from make_runs(), for
+    one), and merging starts on the first of them while later ones are
+    still being made.  Level 0 is the input; with 'streamed', make_runs()
+    reads it and level 1 is what it writes.  Each level after that is
+    one pass, on the other pair of tapes from the one before, down to
+    the first one that's sorted.
+*/
+
+template <class T, class Less>
+class merge_plan
+{
+public:
+    merge_plan(T **base, unsigned int grain, bool streamed);
+    ~merge_plan();
+
+    void add_run(unsigned int side, unsigned int length);
+    void close_level();
+    void input_read(unsigned int side, unsigned int covered);
+    void input_done();
+
+    unsigned int first_pass() const { return first_merge_; }
+    unsigned int last_level() const { return final_; }
+    unsigned int pairs(unsigned int level) const
+    {
+        return levels_[level].pairs;
+    }
+    unsigned int tape(unsigned int level, unsigned int side) const
+    {
+        return levels_[level].side[side].tape;
+    }
+    unsigned int length(unsigned int level, unsigned int side) const
+    {
+        return levels_[level].side[side].length;
+    }
+
+private:
+    merge_plan(const merge_plan &);
+    merge_plan &operator=(const merge_plan &);
+
+    enum level_state { UNKNOWN, SORTED, UNSORTED };
+
+    struct run_piece
+    {
+        unsigned int offset;
+        unsigned int length;
+        T first;
+        T last;
+        unsigned int made_from;         // tasks of the pass before that
+        unsigned int made_to;           // write it: [made_from, made_to)
+    };
+
+    struct reader
+    {
+        unsigned int begin;
+        unsigned int end;
+        merge_task<T> *task;
+    };
+
+    struct parked
+    {
+        unsigned int begin;
+        unsigned int end;
+        merge_task<T> *task;
+
+        bool operator>(const parked &p) const { return end > p.end; }
+    };
+
+    // one side of a level: what's on one of the tapes, and who reads it
+    struct level_tape
+    {
+        unsigned int tape;
+        std::deque<run_piece> runs;     // finished, not yet paired off
+        run_piece open;                 // the run still being added to
+        bool is_open;
+        unsigned int length;
+        bool closed;                    // nothing more coming
+        std::vector<reader> read_by;    // in order
+        unsigned int covered;           // read_by goes this far
+        bool all_read;                  // ... and won't go any further
+        std::vector<parked> writers;    // heap, waiting for read_by to
+                                        // grow past their end
+    };
+
+    struct level
+    {
+        level_tape side[2];
+        level_state state;
+        unsigned int pairs;             // formed so far
+        bool consumed;                  // every pair formed
+        merge_task<T> *batch;           // still taking small pairs
+        std::deque<merge_task<T> > tasks; // the pass reading this level
+    };
+
+    void open_level(unsigned int tape1, unsigned int tape2);
+    void add_piece(level_tape *t, const run_piece &piece);
+    void close_sides(level *l);
+    level_state judge(const level &l) const;
+    void pump();
+    void add_pair(unsigned int l,
+                  const run_piece *r1,
+                  const run_piece *r2);
+    void hook_up(unsigned int l,
+                 merge_task<T> *task,
+                 const run_piece *r1,
+                 const run_piece *r2,
+                 unsigned int side,
+                 const run_piece &piece);
+    void cover(level_tape *t, unsigned int covered, bool all);
+    void wait_for_readers(level_tape *t,
+                          unsigned int begin,
+                          unsigned int end,
+                          merge_task<T> *task);
+
+    merge_task<T> *new_task(unsigned int l);
+    void depend(merge_task<T> *task, merge_task<T> *on);
+    void release(merge_task<T> *task);
+    void run(merge_task<T> *task);
+
+    T **base_;
+    unsigned int grain_;
+    unsigned int first_merge_;          // the first level pairs come from
+    unsigned int final_;                // the sorted level, once found
+    std::deque<level> levels_;
+    std::mutex graph_;                  // guards 'next' and 'done'
+};
+
+namespace
+{
+    unsigned int n;                     // global
+
+    enum
+    {
+        HAIL_ERIS   = 17,
+        ITERATIONS  = 1,
+        MAX_N       = 42,
+        MAX_VALUE   = 169
+    };
+
+    enum test_type { MANUAL, AUTOMATIC };
+
+    enum input_type { UNIFORM, SORTED, REVERSE, NEARLY, FEW, ORGAN };
+
+    struct input_name
+    {
+        const char *name;
+        input_type input;
+    };
+
+    const input_name inputs[] =
+    {
+        { "uniform",    UNIFORM },
+        { "sorted",     SORTED },
+        { "reverse",    REVERSE },
+        { "nearly",     NEARLY },
+        { "few",        FEW },
+        { "organ",      ORGAN }
+    };
+
+    enum engine_type { CLASSIC, NATURAL, POLYPHASE, KWAY, RADIX, COUNTING,
+                       AUTO };
+
+    struct engine_name
+    {
+        const char *name;
+        engine_type engine;
+    };
+
+    const engine_name engines[] =
+    {
+        { "classic",    CLASSIC },
+        { "natural",    NATURAL },
+        { "polyphase",  POLYPHASE },
+        { "kway",       KWAY },
+        { "radix",      RADIX },
+        { "counting",   COUNTING },
+        { "auto",       AUTO }
+    };
+
+    enum record_type { U32, U64, WIDE };
+
+    struct record_name
+    {
+        const char *name;
+        record_type record;
+    };
+
+    const record_name records[] =
+    {
+        { "u32",        U32 },
+        { "u64",        U64 },
+        { "wide",       WIDE }
+    };
+
+    /*!
+        A record that's mostly payload: a 64 bit key and enough bytes
+        riding along with it to fill a cache line.  Sorted on the key
+        alone, and printed as just the key.
+    */
+
+    struct wide_record
+    {
+        uint64_t key;
+        unsigned char payload[56];
+    };
+
+    struct key_less
+    {
+        bool operator()(const wide_record &a, const wide_record &b) const
+        {
+            return a.key < b.key;
+        }
+    };
+
+    std::ostream &operator<<(std::ostream &out, const wide_record &r)
+    {
+        return out << r.key;
+    }
+
+    /*!
+        What goes on the tapes in place of a record when sorting with
+        '-p': its key, and where the record itself is.  Printed, and
+        compared, as just the key.
+    */
+
+    template <class K>
+    struct key_ref
+    {
+        K key;
+        unsigned int index;
+    };
+
+    template <class K>
+    struct key_ref_less
+    {
+        bool operator()(const key_ref<K> &a, const key_ref<K> &b) const
+        {
+            return a.key < b.key;
+        }
+    };
+
+    template <class K>
+    std::ostream &operator<<(std::ostream &out, const key_ref<K> &r)
+    {
+        return out << r.key;
+    }
+
+    /*!
+        Whether 'Less' puts records in the order of their key_of(),
+        smallest first: what sorting them by the bits of their keys
+        takes.
+    */
+
+    template <class Less>
+    struct orders_by_key : std::false_type { };
+
+    template <>
+    struct orders_by_key<std::less<unsigned int> > : std::true_type { };
+
+    template <>
+    struct orders_by_key<std::less<uint64_t> > : std::true_type { };
+
+    template <>
+    struct orders_by_key<key_less> : std::true_type { };
+
+    template <class K>
+    struct orders_by_key<key_ref_less<K> > : std::true_type { };
+
+    template <class Less>
+    struct orders_by_key<counted_less<Less> > : orders_by_key<Less> { };
+
+    /*!
+        What key_refs get sorted with when the records go by 'Less':
+        counted, if the records are.
+    */
+
+    template <class Less, class K>
+    struct ref_order
+    {
+        typedef key_ref_less<K> type;
+    };
+
+    template <class Less, class K>
+    struct ref_order<counted_less<Less>, K>
+    {
+        typedef counted_less<key_ref_less<K> > type;
+    };
+
+    /*!
+        Whether records are nothing but their key, so that a count of
+        each value says all there is to say about them.
+    */
+
+    template <class T, class Less>
+    struct counts_values
+        : std::integral_constant<bool, std::is_integral<T>::value &&
+                                       orders_by_key<Less>::value> { };
+
+    engine_type engine = AUTO;          // picked with '-e' in main()
+    record_type record = U32;           // '-r': what's on the tapes
+    bool key_sort = false;              // '-p': sort key_refs instead
+    unsigned int run_buffer = 0;        // '-b': replacement selection size
+    unsigned int tape_count = 4;        // '-k': tapes for the k-way engine
+    const char *tape_dir = 0;           // '-f'/'-m': keep tapes in files
+    bool map_tapes = false;             // '-m': ... and map them
+    unsigned int tape_depth = 4;        // '-q': blocks in flight per tape
+    unsigned int threads = 1;           // '-j': threads to merge with
+    worker_pool *pool = 0;              // ... if there's more than one
+    merge_kernel_t merge_kernel = 0;    // SIMD merge, if the CPU has one
+    const char *merge_kernel_name = "scalar";
+    const char *metrics_file = 0;       // '-M': where the JSON goes
+    unsigned int pass_count = 0;        // passes end_pass() has seen
+    unsigned int bench_runs = 0;        // '-B': benchmark, this many times
+    unsigned int bench_seed = 1;        // '-s': ... on inputs from here
+    bool huge_pages = false;            // '-H': tape rings on huge pages
+    tape_arena arena;                   // ... which memory tapes live in
+    const char *stream_in = 0;          // '-i': sort this ('-': stdin)
+    const char *stream_out = "-";       // '-o': ... into this
+    bool stream_text = true;            // '-F': ... as text, or binary
+
+    // '-i' reads and writes STREAM_BUFFER bytes at a time, and deals
+    // the records out to t1 and t2 STREAM_BATCH at a time
+    const unsigned int STREAM_BUFFER = 1 << 20;
+    const unsigned int STREAM_BATCH = 1 << 16;
+
+    // "00" to "99", for format_key() to put down two digits at a time
+    const char DIGIT_PAIRS[] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+
+    const uint64_t POWERS_OF_TEN[9] =
+    {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+    };
+
+    // '-T': traces go into a ring of the last TRACE_RING of them, with
+    // at most TRACE_HEAD values off each tape, instead of onto cout
+    const unsigned int TRACE_RING = 64;
+    const unsigned int TRACE_HEAD = 8;
+    bool trace_ring = false;
+    std::string trace_entries[TRACE_RING];
+    unsigned int trace_count = 0;       // entries ever made
+
+    /*!
+        What one pass did to one tape, and to all of them: see
+        end_pass().
+    */
+
+    struct tape_delta
+    {
+        unsigned int id;
+        unsigned long long reads;
+        unsigned long long writes;
+        unsigned long long rewinds;
+        unsigned long long bytes;
+    };
+
+    struct pass_meter
+    {
+        const char *what;               // which kind of pass
+        unsigned long long ns;
+        unsigned long long compares;
+        std::vector<tape_delta> tapes;
+    };
+
+    std::vector<pass_meter> passes;     // everything measured so far
+
+    // where the pass under way started
+    std::vector<tape_delta> pass_seen;
+    unsigned long long pass_compares = 0;
+    std::chrono::steady_clock::time_point pass_start;
+
+    #define RAND(a,b) static_cast<a>(drand48() * (b))
+
+    /*!
+        A tape as polyphase sees it.  Runs here can't be told apart by
+        looking for descents: two runs that happen to line up would
+        read back as one and throw the Fibonacci counts off.  So the
+        length of each run is kept alongside, the way a real tape
+        would carry end-of-run marks.
+    */
+
+    template <class T, class Less>
+    struct phase_tape
+    {
+        tape_t<T, Less> *tape;
+        std::deque<unsigned int> runs;  // lengths, oldest first
+        unsigned int dummies;           // empty runs owed to the count
+    };
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Prototypes
+////////////////////////////////////////////////////////////////////////////////
+
+void tape_error(const char *what);
+void dump_trace(std::ostream &out);
+void dump_trace_on_abort(int);
+void start_pass();
+void end_pass(const char *what, unsigned int count = 1);
+void write_metrics(std::ostream &out);
+
+template <class T>
+T key_of(const T &r);
+uint64_t key_of(const wide_record &r);
+template <class K>
+K key_of(const key_ref<K> &r);
+
+template <class T>
+void copy_records(const T *from, unsigned int count, T *to);
+template <class T>
+void copy_records(const T *from,
+                  unsigned int count,
+                  T *to,
+                  std::true_type trivial);
+template <class T>
+void copy_records(const T *from,
+                  unsigned int count,
+                  T *to,
+                  std::false_type trivial);
+
+template <class T, class Less>
+bool is_full(tape_t<T, Less> *t);
+template <class T, class Less>
+bool is_end(tape_t<T, Less> *t1);
+template <class T, class Less>
+bool read(tape_t<T, Less> *t, T *d);
+template <class T, class Less>
+int read(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T *d);
+template <class T, class Less>
+unsigned int read(tape_t<T, Less> *t, T *d, unsigned int max);
+template <class T, class Less>
+unsigned int read(tape_t<T, Less> *t1,
+                  tape_t<T, Less> *t2,
+                  T *d,
+                  unsigned int max);
+template <class T, class Less>
+void write(tape_t<T, Less> *t, T data);
+template <class T, class Less>
+void write(T data, tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void write(tape_t<T, Less> *t, const T *d, unsigned int count);
+template <class T, class Less>
+void write(tape_t<T, Less> *t1,
+           tape_t<T, Less> *t2,
+           const T *d,
+           unsigned int count);
+template <class T, class Less>
+void rewind(tape_t<T, Less> *tape);
+template <class T, class Less>
+void size_tapes(tape_t<T, Less> *t1,
+                tape_t<T, Less> *t2,
+                tape_t<T, Less> *t3,
+                tape_t<T, Less> *t4);
+template <class T, class Less>
+void size_tapes(tape_t<T, Less> *const *tapes, unsigned int count);
+template <class T, class Less>
+bool is_sorted (tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+
+template <class T, class Less>
+void print_single(tape_t<T, Less> *t);
+template <class T, class Less>
+void print_head(std::ostream &out, tape_t<T, Less> *t);
+template <class T, class Less>
+void print(tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void print_all(T x,
+               T y,
+               tape_t<T, Less> *s1,
+               tape_t<T, Less> *s2,
+               tape_t<T, Less> *d1,
+               tape_t<T, Less> *d2);
+
+template <class T, class Less>
+bool write_data(tape_t<T, Less> **to_write,
+                tape_t<T, Less> *d1,
+                tape_t<T, Less> *d2,
+                tape_t<T, Less> *source,
+                T *data,
+                bool cross);
+
+template <class T, class Less>
+void sort_classic(tape_t<T, Less> *t1,
+                  tape_t<T, Less> *t2,
+                  tape_t<T, Less> *t3,
+                  tape_t<T, Less> *t4);
+
+template <class T, class Less>
+unsigned int co_rank(const T *a,
+                     unsigned int la,
+                     const T *b,
+                     unsigned int lb,
+                     unsigned int k,
+                     unsigned int *ia,
+                     unsigned int *ib);
+#ifdef HAVE_X86_KERNELS
+unsigned int merge_sse41(const data_t *a,
+                         unsigned int la,
+                         const data_t *b,
+                         unsigned int lb,
+                         data_t *out,
+                         unsigned int room,
+                         unsigned int *ia,
+                         unsigned int *ib);
+unsigned int merge_avx2(const data_t *a,
+                        unsigned int la,
+                        const data_t *b,
+                        unsigned int lb,
+                        data_t *out,
+                        unsigned int room,
+                        unsigned int *ia,
+                        unsigned int *ib);
+#endif
+template <class T, class Less>
+unsigned int merge_branchless(const T *a,
+                              unsigned int la,
+                              const T *b,
+                              unsigned int lb,
+                              T *out,
+                              unsigned int room,
+                              unsigned int *ia,
+                              unsigned int *ib);
+merge_kernel_t pick_merge_kernel(const char **name);
+template <class T, class Less>
+unsigned int vector_merge(const T *a,
+                          unsigned int la,
+                          const T *b,
+                          unsigned int lb,
+                          T *out,
+                          unsigned int room,
+                          unsigned int *ia,
+                          unsigned int *ib);
+template <>
+unsigned int vector_merge<data_t, std::less<data_t> >(const data_t *a,
+                                                      unsigned int la,
+                                                      const data_t *b,
+                                                      unsigned int lb,
+                                                      data_t *out,
+                                                      unsigned int room,
+                                                      unsigned int *ia,
+                                                      unsigned int *ib);
+template <>
+unsigned int
+vector_merge<data_t, counted_less<std::less<data_t> > >(const data_t *a,
+                                                         unsigned int la,
+                                                         const data_t *b,
+                                                         unsigned int lb,
+                                                         data_t *out,
+                                                         unsigned int room,
+                                                         unsigned int *ia,
+                                                         unsigned int *ib);
+template <class T, class Less>
+unsigned int run_extent(const T *a, unsigned int length);
+template <class T, class Less>
+void merge_all(const T *a,
+               unsigned int la,
+               const T *b,
+               unsigned int lb,
+               T *out);
+template <class T, class Less>
+void run_starts(const T *a,
+                unsigned int length,
+                std::vector<unsigned int> *starts);
+
+template <class T, class Less>
+unsigned int copy_run(tape_t<T, Less> *s, tape_t<T, Less> *d);
+template <class T, class Less>
+void merge_run(tape_t<T, Less> *s1, tape_t<T, Less> *s2, tape_t<T, Less> *d);
+template <class T, class Less>
+unsigned int merge_pass(tape_t<T, Less> *s1,
+                        tape_t<T, Less> *s2,
+                        tape_t<T, Less> *d1,
+                        tape_t<T, Less> *d2);
+template <class T, class Less>
+void merge_slice(const T *a,
+                 unsigned int la,
+                 const T *b,
+                 unsigned int lb,
+                 T *out,
+                 unsigned int begin,
+                 unsigned int end);
+template <class T, class Less>
+unsigned int make_runs(tape_t<T, Less> *s1,
+                       tape_t<T, Less> *s2,
+                       tape_t<T, Less> *d1,
+                       tape_t<T, Less> *d2,
+                       unsigned int size,
+                       const run_hook_t *finished = 0);
+template <class T, class Less>
+void sort_natural_tasks(tape_t<T, Less> *t1,
+                        tape_t<T, Less> *t2,
+                        tape_t<T, Less> *t3,
+                        tape_t<T, Less> *t4);
+template <class T, class Less>
+void sort_natural(tape_t<T, Less> *t1,
+                  tape_t<T, Less> *t2,
+                  tape_t<T, Less> *t3,
+                  tape_t<T, Less> *t4);
+
+template <class T, class Less>
+void next_level(unsigned int *a, phase_tape<T, Less> *p);
+template <class T, class Less>
+void distribute_runs(tape_t<T, Less> *s1,
+                     tape_t<T, Less> *s2,
+                     phase_tape<T, Less> *p);
+template <class T, class Less>
+unsigned int merge_counted(phase_tape<T, Less> **in,
+                           unsigned int *length,
+                           unsigned int ways,
+                           tape_t<T, Less> *d);
+template <class T, class Less>
+unsigned int merge_phase(phase_tape<T, Less> **in, phase_tape<T, Less> *out);
+template <class T, class Less>
+void sort_polyphase(tape_t<T, Less> *t1,
+                    tape_t<T, Less> *t2,
+                    tape_t<T, Less> *t3,
+                    tape_t<T, Less> *t4);
+
+template <class T, class Less>
+unsigned int merge_run_kway(std::vector<tape_t<T, Less> *> &in,
+                            tape_t<T, Less> *d,
+                            loser_tree<T, Less> *tree);
+template <class T, class Less>
+unsigned int merge_pass_kway(std::vector<tape_t<T, Less> *> &in,
+                             std::vector<tape_t<T, Less> *> &out);
+template <class T, class Less>
+void sort_kway(tape_t<T, Less> *t1,
+               tape_t<T, Less> *t2,
+               tape_t<T, Less> *t3,
+               tape_t<T, Less> *t4);
+
+template <class T, class Less>
+bool key_bits(tape_t<T, Less> *t1,
+              tape_t<T, Less> *t2,
+              decltype(key_of(T())) *vary,
+              decltype(key_of(T())) *top = 0);
+template <class T, class Less>
+unsigned int radix_pass(tape_t<T, Less> *s1,
+                        tape_t<T, Less> *s2,
+                        tape_t<T, Less> *d1,
+                        tape_t<T, Less> *d2,
+                        unsigned int bit,
+                        decltype(key_of(T())) *vary);
+template <class T, class Less>
+void sort_radix(tape_t<T, Less> *t1,
+                tape_t<T, Less> *t2,
+                tape_t<T, Less> *t3,
+                tape_t<T, Less> *t4);
+template <class T, class Less>
+bool radix_pays(tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void sort_auto(tape_t<T, Less> *t1,
+               tape_t<T, Less> *t2,
+               tape_t<T, Less> *t3,
+               tape_t<T, Less> *t4);
+template <class T, class Less>
+void write_counts(const std::vector<unsigned int> &counts,
+                  tape_t<T, Less> *t1,
+                  tape_t<T, Less> *t2);
+template <class T, class Less>
+void sort_counting(tape_t<T, Less> *t1,
+                   tape_t<T, Less> *t2,
+                   tape_t<T, Less> *t3,
+                   tape_t<T, Less> *t4);
+template <class T, class Less>
+void sort_counting(tape_t<T, Less> *t1,
+                   tape_t<T, Less> *t2,
+                   tape_t<T, Less> *t3,
+                   tape_t<T, Less> *t4,
+                   std::true_type);
+template <class T, class Less>
+void sort_counting(tape_t<T, Less> *t1,
+                   tape_t<T, Less> *t2,
+                   tape_t<T, Less> *t3,
+                   tape_t<T, Less> *t4,
+                   std::false_type);
+
+template <class T, class Less>
+void sort(tape_t<T, Less> *t1,
+          tape_t<T, Less> *t2,
+          tape_t<T, Less> *t3,
+          tape_t<T, Less> *t4);
+
+template <class T, class Less>
+void sort_keys(tape_t<T, Less> *t1,
+               tape_t<T, Less> *t2,
+               tape_t<T, Less> *t3,
+               tape_t<T, Less> *t4);
+
+template <class T>
+T make_record(unsigned int value);
+template <>
+wide_record make_record<wide_record>(unsigned int value);
+template <class T, class Less>
+void run_test(test_type bob, const char *size);
+template <class T, class Less>
+void run_measured(test_type bob, const char *size);
+void generate(input_type kind,
+              unsigned int count,
+              unsigned int seed,
+              std::vector<unsigned int> *out);
+template <class T, class Less>
+void bench(unsigned int max_n, bool every_engine);
+
+void stream_error(const char *name, const char *what);
+int open_stream(const char *name, bool out);
+void write_out(int fd, const char *d, size_t length);
+unsigned int format_key(uint64_t key, char *to);
+unsigned int digit_run(uint64_t chars);
+uint64_t parse_digits(uint64_t chars, unsigned int length);
+template <class T>
+T record_of(uint64_t key);
+template <>
+wide_record record_of<wide_record>(uint64_t key);
+template <class T, class Less>
+void deal(std::vector<T> *batch,
+          tape_t<T, Less> *t1,
+          tape_t<T, Less> *t2,
+          unsigned int *batches);
+template <class T, class Less>
+void parse_keys(const char *p,
+                const char *end,
+                std::vector<T> *batch,
+                tape_t<T, Less> *t1,
+                tape_t<T, Less> *t2,
+                unsigned int *batches);
+template <class T, class Less>
+void read_text(int fd, tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void read_binary(int fd, tape_t<T, Less> *t1, tape_t<T, Less> *t2);
+template <class T, class Less>
+void write_text(int fd, tape_t<T, Less> *const *tapes, unsigned int count);
+template <class T, class Less>
+void write_binary(int fd,
+                  tape_t<T, Less> *const *tapes,
+                  unsigned int count);
+template <class T, class Less>
+void run_stream();
+
+bool parse_engine(const char *name, engine_type *e);
+bool parse_record(const char *name, record_type *r);
+void usage(const char *program);
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Definitions
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+    Tape I/O errors aren't anything the sort can work around.  They go
+    to cerr: with '-i', cout is the sorted data, and it's shut off while
+    the sort runs anyway.
+*/
+
+void
+tape_error(const char *what)
+{
+    std::cerr << "tape: " << what << ": " << strerror(errno) << "\n";
+    exit(1);
+}
+
+std::vector<tape_meter *> tape_meter::all;
+std::atomic<unsigned long long> compare_count::asked(0);
+
+tape_meter::tape_meter(unsigned int size)
+    : size(size), reads(0), writes(0), rewinds(0)
+{
+    static unsigned int made = 0;
+    id = made++;
+    all.push_back(this);
+}
+
+tape_meter::~tape_meter()
+{
+    all.erase(std::find(all.begin(), all.end(), this));
+}
+
+tape_arena::~tape_arena()
+{
+    for (unsigned int i = 0; i < regions_.size(); ++i)
+        munmap(regions_[i].base, regions_[i].size);
+}
+
+/*!
+    Makes sure the next slices, 'bytes' of them all told, fit in the
+    newest mapping.
+*/
+
+void
+tape_arena::expect(size_t bytes)
+{
+    if (bytes && !room(bytes))
+        map(bytes);
+}
+
+/*!
+    A slice of at least 'bytes', from the newest mapping if it has room
+    and from a new one (twice the size, to keep the number of them
+    down) if not.
+*/
+
+void *
+tape_arena::take(size_t bytes)
+{
+    bytes = round(bytes);
+    if (!room(bytes))
+        map(std::max(bytes, regions_.empty() ? 0 : 2 * regions_.back().size));
+
+    region &r = regions_.back();
+    void *slice = r.base + r.used;
+    r.used += bytes;
+    ++r.slices;
+    return slice;
+}
+
+/*!
+    Hands back a slice take() handed out.  An older mapping goes away
+    with its last slice; the newest one stays, to be handed out again.
+*/
+
+void
+tape_arena::give(void *slice)
+{
+    for (unsigned int i = 0; i < regions_.size(); ++i)
+    {
+        region &r = regions_[i];
+        if (slice < r.base || slice >= r.base + r.size)
+            continue;
+        if (--r.slices)
+            return;
+
+        if (i + 1 == regions_.size())
+            r.used = 0;
+        else
+        {
+            munmap(r.base, r.size);
+            regions_.erase(regions_.begin() + i);
+        }
+        return;
+    }
+    assert(!"slice from somewhere else");
+}
+
+bool
+tape_arena::room(size_t bytes) const
+{
+    return !regions_.empty() &&
+           regions_.back().size - regions_.back().used >= bytes;
+}
+
+/*!
+    A new mapping of at least 'bytes', in whole huge pages (whether or
+    not it's made of them).  Nothing's committed until it's touched, so
+    sizing for the worst case costs address space and not memory.  An
+    empty mapping it replaces goes away.
+*/
+
+void
+tape_arena::map(size_t bytes)
+{
+    if (!regions_.empty() && !regions_.back().slices)
+    {
+        munmap(regions_.back().base, regions_.back().size);
+        regions_.pop_back();
+    }
+
+    const size_t HUGE_PAGE = 2 << 20;
+    region r = { 0, (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1), 0, 0 };
+    // reserved huge pages have to be there up front: a mapping that
+    // only found out it was short when touched would die of SIGBUS
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *p = MAP_FAILED;
+    if (huge_pages)
+        p = mmap(0, r.size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                 -1, 0);
+    if (p == MAP_FAILED)
+    {
+        p = mmap(0, r.size, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE,
+                 -1, 0);
+        if (p == MAP_FAILED)
+            tape_error("mmap");
+        if (huge_pages)
+            madvise(p, r.size, MADV_HUGEPAGE);
+    }
+    r.base = static_cast<char *>(p);
+    regions_.push_back(r);
+}
+
+/*!
+    Moves 'count' records from 'from' to 'to' (which don't overlap).
+    Records that are just bytes go with memcpy(); anything else gets
+    copied one at a time, properly.
+*/
+
+template <class T>
+void
+copy_records(const T *from, unsigned int count, T *to)
+{
+    copy_records(from, count, to, std::is_trivially_copyable<T>());
+}
+
+template <class T>
+void
+copy_records
+(
+    const T *from,
+    unsigned int count,
+    T *to,
+    std::true_type
+)
+{
+    if (count)
+        memcpy(to, from, size_t(count) * sizeof(T));
+}
+
+template <class T>
+void
+copy_records
+(
+    const T *from,
+    unsigned int count,
+    T *to,
+    std::false_type
+)
+{
+    std::copy(from, from + count, to);
+}
+
+template <class T, class Less>
+const unsigned int tape_t<T, Less>::BLOCK;
+
+template <class T, class Less>
+tape_t<T, Less>::~tape_t()
+{
+    if (lent_)
+        arena.give(buf_);
+    if (mapped_)
+        munmap(buf_, cap_ * sizeof(T));
+    if (buffered())
+    {
+        for (unsigned int b = 0; b < io_.size(); ++b)
+            wait(b);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stop_ = true;
+        }
+        work_.notify_one();
+        thread_.join();
+    }
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+/*!
+    Moves the (empty) tape into a file under 'dir', either 'mapped' or
+    buffered 'depth' blocks deep.  The file is unlinked as soon as it's
+    open, so it goes away with the tape however the program ends.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::attach(const char *dir, bool mapped, unsigned int depth)
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "file tapes hold records as raw bytes");
+    assert(fd_ < 0 && empty());
+
+    const std::string path = std::string(dir) + "/tapeXXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+
+    fd_ = mkstemp(&name[0]);
+    if (fd_ < 0)
+        tape_error(&name[0]);
+    unlink(&name[0]);
+
+    if (lent_)
+        arena.give(buf_);
+    lent_ = false;
+
+    if (mapped)
+    {
+        std::vector<T>().swap(mem_);
+        buf_ = 0;
+        cap_ = 0;
+        mapped_ = true;
+        map(sysconf(_SC_PAGESIZE) / sizeof(T));
+    } else
+    {
+        assert(depth >= 2);
+        mem_.assign(depth * BLOCK, T());
+        buf_ = &mem_[0];
+        cap_ = mem_.size();
+        io_.assign(depth, block_io());
+        thread_ = std::thread(&tape_t<T, Less>::io_loop, this);
+    }
+    clear();
+}
+
+template <class T, class Less>
+void
+tape_t<T, Less>::clear()
+{
+    if (buffered())
+    {
+        for (unsigned int b = 0; b < io_.size(); ++b)
+            wait(b);
+        rpos_ = wpos_ = pending_ = 0;
+        reading_ = false;
+        get_mark_ = ~0u;
+        put_mark_ = BLOCK;
+    }
+    head_ = tail_ = count_ = 0;
+}
+
+/*!
+    The i'th value from the read cursor, wherever it happens to be.
+*/
+
+template <class T, class Less>
+T
+tape_t<T, Less>::at(unsigned int i)
+{
+    if (!buffered())
+        return buf_[wrap(head_ + i)];
+
+    T d;
+    peek(i, &d, 1);
+    return d;
+}
+
+/*!
+    Up to 'max' values from the i'th from the read cursor on, into 'd'.
+    Returns how many there were.  Anything that isn't in the buffer
+    comes straight from the file, as many values to a pread() as there
+    are in a row, so this is for printing tapes, not for sorting them.
+*/
+
+template <class T, class Less>
+unsigned int
+tape_t<T, Less>::peek(unsigned int i, T *d, unsigned int max)
+{
+    max = i < size() ? std::min(max, size() - i) : 0;
+    if (!buffered())
+    {
+        for (unsigned int k = 0; k < max; ++k)
+            d[k] = buf_[wrap(head_ + i + k)];
+        return max;
+    }
+
+    unsigned int got = 0;
+    while (got < max)
+    {
+        unsigned int pos;
+        unsigned int length = max - got;
+        if (reading_)
+        {
+            if (i < count_)
+            {
+                length = std::min(length, count_ - i);
+                copy_records(buf_ + head_ + i, length, d + got);
+                got += length;
+                i += length;
+                continue;
+            }
+            pos = rpos_ - pending_ + (i - count_);
+        } else
+        {
+            if (i >= wpos_)
+            {
+                copy_records(buf_ + head_ + (i - wpos_), length, d + got);
+                got += length;
+                i += length;
+                continue;
+            }
+            length = std::min(length, wpos_ - i);
+            for (unsigned int b = 0; b < io_.size(); ++b)
+                wait(b);
+            pos = i;
+        }
+
+        const ssize_t bytes = ssize_t(length) * sizeof(T);
+        if (pread(fd_, d + got, bytes, off_t(pos) * sizeof(T)) != bytes)
+            tape_error("pread");
+        got += length;
+        i += length;
+    }
+    return max;
+}
+
+/*!
+    Makes the ring bigger: a new slice of the arena, for a memory tape
+    of trivially copyable records, or a bigger vector.  Whatever was
+    there stays at the same offset, so if the ring had wrapped, the
+    part at the front of the buffer is moved to follow on from the old
+    end.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::grow(unsigned int capacity)
+{
+    assert(!buffered());
+
+    const unsigned int old = cap_;
+    if (mapped_)
+        map(capacity);
+    else if (!std::is_trivially_copyable<T>::value)
+    {
+        mem_.resize(capacity);
+        buf_ = &mem_[0];
+        cap_ = capacity;
+    } else
+    {
+        T *ring = static_cast<T *>(arena.take(size_t(capacity) * sizeof(T)));
+        copy_records(buf_, old, ring);
+        if (lent_)
+            arena.give(buf_);
+        else
+            std::vector<T>().swap(mem_);
+        buf_ = ring;
+        lent_ = true;
+        cap_ = capacity;
+    }
+
+    if (!count_)
+        head_ = tail_ = 0;
+    else if (tail_ <= head_)
+    {
+        copy_records(buf_, tail_, buf_ + old);
+        tail_ = wrap(old + tail_);
+    }
+}
+
+/*!
+    (Re)maps the tape's file at 'capacity' values, stretching the file to
+    match.  The contents so far stay where they were.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::map(unsigned int capacity)
+{
+    const size_t bytes = size_t(capacity) * sizeof(T);
+    if (ftruncate(fd_, bytes) < 0)
+        tape_error("ftruncate");
+
+    void *p = buf_ ? mremap(buf_, size_t(cap_) * sizeof(T), bytes,
+                            MREMAP_MAYMOVE)
+                   : mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd_, 0);
+    if (p == MAP_FAILED)
+        tape_error("mmap");
+    madvise(p, bytes, MADV_SEQUENTIAL);
+
+    buf_ = static_cast<T *>(p);
+    cap_ = capacity;
+}
+
+/*!
+    get() has just used up a block and moved into the next one.  The
+    block it left is free, so it goes back to the I/O thread for the
+    next block of the file; then wait for the new one to be filled.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::next_block()
+{
+    const unsigned int depth = io_.size();
+    const unsigned int block = head_ / BLOCK;
+    if (rpos_ < wpos_)
+        submit((block + depth - 1) % depth,
+               std::min(BLOCK, wpos_ - rpos_),
+               false);
+    wait(block);
+    get_mark_ = wrap(head_ + BLOCK);
+}
+
+/*!
+    put() has just filled a block: queue it to be written, and make sure
+    the block it's moving into has finished going out before it gets
+    written over.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::flush_block()
+{
+    const unsigned int depth = io_.size();
+    const unsigned int block = tail_ / BLOCK;
+    submit((block + depth - 1) % depth, BLOCK, true);
+    wait(block);
+    head_ = tail_;
+    count_ = 0;
+    put_mark_ = wrap(tail_ + BLOCK);
+}
+
+/*!
+    Written tape: flush the partial block and start reading from the
+    top.  A tape short enough that it never left the buffer just flips
+    over to reading.  Tape that's been read dry: get ready to write from
+    the top.  Tape that's partly read: nothing, carry on where it was.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::rewind_file()
+{
+    if (reading_)
+    {
+        if (empty())
+            clear();
+        return;
+    }
+
+    if (empty())
+        return;
+
+    put_mark_ = ~0u;
+    get_mark_ = BLOCK;
+    if (!wpos_)
+    {
+        reading_ = true;
+        return;
+    }
+
+    for (unsigned int b = 0; b < io_.size(); ++b)
+        wait(b);
+    reading_ = true;
+    if (count_)
+    {
+        const ssize_t bytes = count_ * sizeof(T);
+        if (pwrite(fd_, &buf_[head_], bytes, off_t(wpos_) * sizeof(T))
+            != bytes)
+            tape_error("pwrite");
+        wpos_ += count_;
+    }
+
+    head_ = tail_ = count_ = 0;
+    rpos_ = 0;
+    for (unsigned int b = 0; b < io_.size() && rpos_ < wpos_; ++b)
+        submit(b, std::min(BLOCK, wpos_ - rpos_), false);
+    wait(0);
+}
+
+/*!
+    Hands 'block' of the buffer to the I/O thread to transfer 'length'
+    values: at the write offset for a write, the read offset for a read.
+    The offsets move on straight away, so blocks go in file order.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::submit(unsigned int block, unsigned int length, bool write)
+{
+    block_io *io = &io_[block];
+    assert(!io->busy);
+
+    io->offset = off_t(write ? wpos_ : rpos_) * sizeof(T);
+    io->length = length;
+    io->write = write;
+    io->busy = true;
+    io->done = false;
+    io->error = 0;
+
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        queue_.push_back(block);
+    }
+    work_.notify_one();
+
+    if (write)
+        wpos_ += length;
+    else
+    {
+        rpos_ += length;
+        pending_ += length;
+    }
+}
+
+/*!
+    Blocks until the transfer of 'block' (if any) is done.  A finished
+    read hands its values over to get().
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::wait(unsigned int block)
+{
+    block_io *io = &io_[block];
+    if (!io->busy)
+        return;
+
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        while (!io->done)
+            finished_.wait(guard);
+    }
+    io->busy = false;
+
+    if (io->error)
+    {
+        errno = io->error;
+        tape_error(io->write ? "write" : "read");
+    }
+
+    if (reading_)
+    {
+        count_ += io->length;
+        pending_ -= io->length;
+    }
+}
+
+/*!
+    The buffer behind a memory or mapped tape, at least 'capacity'
+    values long, with the tape's contents moved to the front of it.  For
+    work that moves values around behind the tape's back, on several
+    threads at once: hold() tells the tape what's in it afterwards.
+*/
+
+template <class T, class Less>
+T *
+tape_t<T, Less>::buffer(unsigned int capacity)
+{
+    assert(!buffered());
+
+    if (capacity > cap_)
+        grow(capacity);
+    if (head_)
+    {
+        std::rotate(buf_, buf_ + head_, buf_ + cap_);
+        head_ = 0;
+        tail_ = wrap(count_);
+    }
+    return buf_;
+}
+
+/*!
+    The tape now holds the first 'count' values of its buffer, as if
+    they had just been written.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::hold(unsigned int count)
+{
+    assert(!buffered() && count <= cap_);
+
+    // whatever was on it has been read, by somebody
+    meter_.reads += count_;
+    head_ = tail_ = count_ = 0;
+    descents_ = 0;
+    commit(count);
+}
+
+/*!
+    The tape's I/O thread: works through the queued blocks in order
+    until the tape goes away.
+*/
+
+template <class T, class Less>
+void
+tape_t<T, Less>::io_loop()
+{
+    std::unique_lock<std::mutex> guard(lock_);
+    for (;;)
+    {
+        while (!stop_ && queue_.empty())
+            work_.wait(guard);
+        if (queue_.empty())
+            return;
+
+        const unsigned int block = queue_.front();
+        queue_.pop_front();
+        const block_io io = io_[block];
+        guard.unlock();
+
+        char *p = reinterpret_cast<char *>(&buf_[block * BLOCK]);
+        size_t left = io.length * sizeof(T);
+        off_t offset = io.offset;
+        int error = 0;
+        while (left)
+        {
+            const ssize_t moved = io.write ? pwrite(fd_, p, left, offset)
+                                           : pread(fd_, p, left, offset);
+            if (moved <= 0)
+            {
+                error = moved < 0 ? errno : EIO;
+                break;
+            }
+            p += moved;
+            left -= moved;
+            offset += moved;
+        }
+
+        guard.lock();
+        io_[block].done = true;
+        io_[block].error = error;
+        finished_.notify_all();
+    }
+}
+
+thread_local unsigned int worker_pool::self_ = 0;
+
+/*!
+    Starts 'threads' - 1 workers: the thread calling wait() makes up the
+    rest.
+*/
+
+worker_pool::worker_pool(unsigned int threads)
+    : queues_(threads), queued_(0), pending_(0), stop_(false)
+{
+    for (unsigned int i = 1; i < threads; ++i)
+        workers_.push_back(std::thread(&worker_pool::work_loop, this, i));
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (unsigned int i = 0; i < workers_.size(); ++i)
+        workers_[i].join();
+}
+
+void
+worker_pool::spawn(task_t task)
+{
+    ++pending_;
+    ++queued_;
+    {
+        task_queue &q = queues_[self_];
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.tasks.push_back(std::move(task));
+    }
+
+    // take the lock so a thread that just found nothing to do can't
+    // miss this
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+    }
+    wake_.notify_all();
+}
+
+void
+worker_pool::wait()
+{
+    for (;;)
+    {
+        task_t task;
+        if (find(&task))
+        {
+            task();
+            finish();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock_);
+        while (pending_ && !queued_)
+            wake_.wait(guard);
+        if (!pending_)
+            return;
+    }
+}
+
+/*!
+    A worker: runs tasks, its own or stolen, and sleeps when there
+    aren't any.
+*/
+
+void
+worker_pool::work_loop(unsigned int self)
+{
+    self_ = self;
+    for (;;)
+    {
+        task_t task;
+        if (find(&task))
+        {
+            task();
+            finish();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock_);
+        while (!stop_ && !queued_)
+            wake_.wait(guard);
+        if (stop_)
+            return;
+    }
+}
+
+/*!
+    The newest task on this thread's own deque, or failing that the
+    oldest one on the next deque round that has any.
+*/
+
+bool
+worker_pool::find(task_t *task)
+{
+    const unsigned int count = queues_.size();
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        task_queue &q = queues_[(self_ + i) % count];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty())
+            continue;
+
+        if (!i)
+        {
+            *task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else
+        {
+            *task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        --queued_;
+        return true;
+    }
+    return false;
+}
+
+void
+worker_pool::finish()
+{
+    if (!--pending_)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+        }
+        wake_.notify_all();
+    }
+}
+
+/*!
+    Might have to jiggle if 'n' is odd.
+
+    Returns true if tape is full.
+
+    is_full() and is_end() together form the proper IsEnd() of the
+    problem.  It's just clearer to me for the simulated tape to have
+    two routines.
+
+*/
+
+template <class T, class Less>
+bool
+is_full(tape_t<T, Less> *t)
+{
+    return t->size() == n / 2;
+}
+
+/*!
+    You're at the end of the tape if:
+
+        a) Read all data off tape
+        b) Written tape until it's full
+
+    I stuck the 'b' sense in is_full().
+*/
+
+template <class T, class Less>
+bool
+is_end(tape_t<T, Less> *t)
+{
+    return t->empty();
+}
+
+template <class T, class Less>
+bool
+read(tape_t<T, Less> *t, T *d)
+{
+    bool got_data = false;
+    if (!is_end(t))
+    {
+        *d = t->get();
+        got_data = true;
+    }
+    return got_data;
+}
+
+/*!
+    For my simulated tape a read is destructive: the read cursor moves
+    past whatever it hands back, and it's only reused once the tape has
+    been drained and rewound.  The ultimate behavior is the same as
+    you'd get with the tape in the problem.
+*/
+
+template <class T, class Less>
+int
+read(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T *d)
+{
+    int got_data = 0;
+
+    if (!is_end(t1))
+    {
+        *d = t1->get();
+        got_data = 1;
+    } else if (!is_end(t2))
+    {
+        *d = t2->get();
+        got_data = 1;
+    }
+    return got_data;
+}
+
+template <class T, class Less>
+void
+write(tape_t<T, Less> *t, T data)
+{
+    assert(t && !is_full(t));
+    t->put(data);
+}
+
+/*!
+    Batch read: up to 'max' values off 't' into 'd', a span at a time.
+    Returns how many there were.
+*/
+
+template <class T, class Less>
+unsigned int
+read(tape_t<T, Less> *t, T *d, unsigned int max)
+{
+    unsigned int got = 0;
+    while (got < max && !is_end(t))
+    {
+        unsigned int length;
+        const T *span = t->read_span(&length);
+        length = std::min(length, max - got);
+        copy_records(span, length, d + got);
+        t->skip(length);
+        got += length;
+    }
+    return got;
+}
+
+/*!
+    Batch version of reading t1 and t2 as one tape: is_end() gets asked
+    once for each tape, not once a value.
+*/
+
+template <class T, class Less>
+unsigned int
+read(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T *d, unsigned int max)
+{
+    unsigned int got = read(t1, d, max);
+    if (got < max)
+        got += read(t2, d + got, max - got);
+    return got;
+}
+
+/*!
+    Batch write: 'count' values from 'd' onto the end of 't'.
+*/
+
+template <class T, class Less>
+void
+write(tape_t<T, Less> *t, const T *d, unsigned int count)
+{
+    while (count)
+    {
+        unsigned int room;
+        T *span = t->write_span(&room);
+        room = std::min(room, count);
+        copy_records(d, room, span);
+        t->commit(room);
+        d += room;
+        count -= room;
+    }
+}
+
+/*!
+    Put value 'data' on one of t1 or t2: treat them as a single,
+    longer tape of size 'n'.  Having both tapes full makes us 'splode.
+*/
+
+template <class T, class Less>
+void
+write(tape_t<T, Less> *t1, tape_t<T, Less> *t2, T data)
+{
+    assert(!is_full(t1) || !is_full(t2));
+
+    if (!is_full(t1))
+        t1->put(data);
+    else
+        t2->put(data);
+}
+
+/*!
+    Batch version of the above: works out once how much still fits on
+    t1, instead of asking is_full() for every value.
+*/
+
+template <class T, class Less>
+void
+write(tape_t<T, Less> *t1, tape_t<T, Less> *t2, const T *d, unsigned int count)
+{
+    const unsigned int room = n / 2 - std::min(n / 2, t1->size());
+    const unsigned int first = std::min(room, count);
+    assert(count - first <= n - n / 2 - std::min(n - n / 2, t2->size()));
+
+    write(t1, d, first);
+    write(t2, d + first, count - first);
+}
+
+/*!
+    Puts the tape's cursors back at the start of its buffer once it
+    has been read through, so the next pass reuses the same memory.
+
+    Uhm, I consider rewind()s to be O(c).
+*/
+
+template <class T, class Less>
+void
+rewind(tape_t<T, Less> *tape)
+{
+    tape->rewind();
+}
+
+/*!
+    Gives each tape room for all n values (the most any of them can end
+    up with), out of one mapping of the arena.  Done before a sort, no
+    tape grows while it runs, so the passes don't allocate; done again,
+    with the same n, it's free.
+*/
+
+template <class T, class Less>
+void
+size_tapes
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    tape_t<T, Less> *const tapes[4] = { t1, t2, t3, t4 };
+    size_tapes(tapes, 4);
+}
+
+/*!
+    The same for 'count' tapes: the k-way engine's spares, say.
+*/
+
+template <class T, class Less>
+void
+size_tapes(tape_t<T, Less> *const *tapes, unsigned int count)
+{
+    size_t wanted = 0;
+    for (unsigned int i = 0; i < count; ++i)
+        wanted += tapes[i]->wants(n);
+    arena.expect(wanted);
+    for (unsigned int i = 0; i < count; ++i)
+        tapes[i]->reserve(n);
+}
+
+/*!
+    This is O(c): the tapes kept count of their own descents as they
+    were written, so all that's left is the seam between t1 and t2.
+*/
+
+template <class T, class Less>
+bool
+is_sorted (tape_t<T, Less> *t1, tape_t<T, Less> *t2)
+{
+    if (t1->descents() || t2->descents())
+        return false;
+
+    if (t1->empty() || t2->empty())
+        return true;
+
+    // not strictly monotonic: can have several of the same value
+    return !plain_t<Less>()(t2->front(), t1->back());
+}
+
+/*!
+    Contents of a single tape.  The keys get formatted into a buffer
+    with format_key() and go to cout a buffer at a time, and not at all
+    if cout has been shut off.
+*/
+
+template <class T, class Less>
+void
+print_single(tape_t<T, Less> *t)
+{
+    if (!cout)
+        return;
+
+    if (t->empty())
+        cout << "empty ";
+    else
+    {
+        std::vector<char> out(STREAM_BUFFER);
+        std::vector<T> values(tape_t<T, Less>::BLOCK);
+        size_t used = 0;
+        const unsigned int size = t->size();
+        for (unsigned int i = 0; i < size; )
+        {
+            const unsigned int got = t->peek(i, &values[0], values.size());
+            for (unsigned int j = 0; j < got; ++j)
+            {
+                if (out.size() - used < 21)
+                {
+                    cout.write(&out[0], used);
+                    used = 0;
+                }
+                used += format_key(key_of(values[j]), &out[used]);
+                out[used++] = ' ';
+            }
+            i += got;
+        }
+        cout.write(&out[0], used);
+    }
+
+}
+
+template <class T, class Less>
+void
+print(tape_t<T, Less> *t1, tape_t<T, Less> *t2)
+{
+    print_single(t1);
+    cout << " | ";
+    print_single(t2);
+}
+
+/*!
+    How many values a tape has and the first TRACE_HEAD of them, for a
+    trace entry: it has to cost the same however long the tape is.
+*/
+
+template <class T, class Less>
+void
+print_head(std::ostream &out, tape_t<T, Less> *t)
+{
+    T head[TRACE_HEAD];
+    const unsigned int size = t->size();
+    const unsigned int got = t->peek(0, head, TRACE_HEAD);
+    out << "[" << size << ":";
+    for (unsigned int i = 0; i < got; ++i)
+        out << " " << head[i];
+    out << (size > TRACE_HEAD ? " ...]" : "]");
+}
+
+/*!
+    A trace of the classic engine's state: onto cout, or into the ring
+    with '-T'.  Only ever called through TRACE().
+*/
+
+template <class T, class Less>
+void
+print_all
+(
+    T x,
+    T y,
+    tape_t<T, Less> *s1,
+    tape_t<T, Less> *s2,
+    tape_t<T, Less> *d1,
+    tape_t<T, Less> *d2
+)
+{
+    if (trace_ring)
+    {
+        std::ostringstream out;
+        out << "x: " << x << " y: " << y << " ";
+        print_head(out, s1);
+        print_head(out, s2);
+        out << " -> ";
+        print_head(out, d1);
+        print_head(out, d2);
+        out << "\n";
+        trace_entries[trace_count++ % TRACE_RING] = out.str();
+        return;
+    }
+
+    cout << "\nx: " << x << " y: " << y << "\n";
+    print(s1, s2);
+    cout << "\t\t";
+    print(d1, d2);
+    cout << "\n";
+}
+
+/*!
+    What's in the trace ring, oldest first, onto 'out'.
+*/
+
+void
+dump_trace(std::ostream &out)
+{
+    const unsigned int kept = std::min(trace_count, TRACE_RING);
+    out << "Last " << kept << " of " << trace_count << " traces:\n";
+    for (unsigned int i = trace_count - kept; i < trace_count; ++i)
+        out << trace_entries[i % TRACE_RING];
+}
+
+/*!
+    The same, for when an assert() goes off: straight to stderr with
+    write(), since cout is in whatever state the program died in.
+*/
+
+void
+dump_trace_on_abort(int)
+{
+    const unsigned int kept = std::min(trace_count, TRACE_RING);
+    for (unsigned int i = trace_count - kept; i < trace_count; ++i)
+    {
+        const std::string &e = trace_entries[i % TRACE_RING];
+        if (::write(2, e.data(), e.size()) < 0)
+            break;
+    }
+    signal(SIGABRT, SIG_DFL);
+}
+
+
+template <class T, class Less>
+bool
+write_data
+(
+    tape_t<T, Less> **to_write,
+    tape_t<T, Less> *d1,
+    tape_t<T, Less> *d2,
+    tape_t<T, Less> *source,
+    tape_t<T, Less> *alternate,
+    T *data,
+    bool cross
+)
+{
+    assert(to_write);
+    assert(*to_write);
+    assert(d1);
+    assert(d2);
+    assert(source);
+    assert(data);
+
+    T d = *data;
+    bool got_data = false;
+
+    if (cross)
+    {
+        // if on 'cross', smallest value goes on opposite of last tape
+        // we wrote to
+        write(*to_write, d);
+
+        // Here is what switches destination tapes
+        *to_write = ((*to_write) == d1 ? d2 : d1);
+        // Need a new value: read next element from tape
+        got_data = read(source, data);
+        if (!got_data)
+        {
+            got_data = read(alternate, &d);
+            while (got_data)
+            {
+                write(d1, d2, d);
+                got_data = read(alternate, &d);
+            }
+        }
+    } else
+    {
+        // else just write linearly along tape
+        write(d1, d2, d);
+        // Need a new x: read next element from tape where
+        // we got x: this is source1
+        got_data = read(source, data);
+        if (!got_data)
+        {
+            got_data = read(alternate, &d);
+            while (got_data)
+            {
+                write(d1, d2, d);
+                got_data = read(alternate, &d);
+            }
+        }
+    }
+    return got_data;
+}
+
+/*!
+    The original engine: fixed alternating passes, flipping 'cross'
+    each time.
+*/
+
+template <class T, class Less>
+void
+sort_classic
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    tape_t<T, Less> *source1 = t1;
+    tape_t<T, Less> *source2 = t2;
+    tape_t<T, Less> *dest1 = t3;
+    tape_t<T, Less> *dest2 = t4;
+    tape_t<T, Less> *to_write = t3;
+
+    T x, y;
+    unsigned int count = 17;    // whatever, as long as > 3
+    bool cross = true, got_data = false;
+    x = y = T();
+
+    // small "hand-coded" sorts for n < 3
+    if (n < 3)
+    {
+        count = 0;
+        count += read(source1, source2, &x);
+        count += read(source1, source2, &y);
+    }
+
+    switch (count)
+    {
+    case 0:
+        // no elements to sort
+        print(dest1, dest2);
+        return;
+
+    case 1:
+        // sorted already;
+        write(dest1, dest2, x);
+        print(dest1, dest2);
+        return;
+
+    case 2:
+        TRACE(1, print_all(x, y, source1, source2, dest1, dest2));
+        if (Less()(x, y))
+        {
+            write(dest1, dest2, x);
+            write(dest1, dest2, y);
+        } else
+        {
+            write(dest1, dest2, y);
+            write(dest1, dest2, x);
+        }
+
+        print(dest1, dest2);
+        return;
+    }
+
+    TRACE(1, print_all(x, y, source1, source2, dest1, dest2));
+
+    // "big" routine needs tweaking for odd numbers: n / 2 not so good.
+    count = 0;
+    while (!is_sorted(source1, source2))
+    {
         // read initial 2 elements: 1 from each source array
         got_data = read(source1, &x) && read(source2, &y);
         // Damn well better not be empty on 1st pass (caught above)
         while (got_data)
         {
-            if (x < y)
-                write_data(&to_write, dest1, dest2, source1, source2, &x, cross);
-            else
-                write_data(&to_write, dest1, dest2, source2, source1, &y, cross);
+            if (Less()(x, y))
+                write_data(&to_write, dest1, dest2, source1, source2, &x, cross);
+            else
+                write_data(&to_write, dest1, dest2, source2, source1, &y, cross);
+
+            TRACE(2, print_all(x, y, source1, source2, dest1, dest2));
+        }
+        TRACE(1, print_all(x, y, source1, source2, dest1, dest2));
+
+        // source tapes are empty: switch source and dest pointers
+        std::swap(source1, dest1);
+        std::swap(source2, dest2);
+
+        // Another pass (over n elements) complete: rewind tapes
+        rewind(source1);
+        rewind(source2);
+        rewind(dest1);
+        rewind(dest2);
+        ++count;
+        cross = !cross;
+        end_pass("merge");
+    }
+
+    cout << "\n\nIn " << count << " passes: ";
+    print(source1, source2);
+    cout << "\n\n\n";
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*!
+    Bitonic merge network, eight lanes: 'lo' and 'hi' come in sorted and
+    go out as the eight smallest and eight largest of the sixteen, both
+    sorted.  Reversing 'hi' makes the pair bitonic; one min/max splits
+    it into two bitonic halves, and three rounds of compare-and-swap at
+    distances 4, 2 and 1 sort each of them.
+*/
+
+__attribute__((target("avx2")))
+inline void
+bitonic_avx2(__m256i *lo, __m256i *hi)
+{
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i b = _mm256_permutevar8x32_epi32(*hi, reverse);
+    __m256i l = _mm256_min_epu32(*lo, b);
+    __m256i h = _mm256_max_epu32(*lo, b);
+    __m256i pl, ph;
+
+    pl = _mm256_permute2x128_si256(l, l, 1);
+    ph = _mm256_permute2x128_si256(h, h, 1);
+    l = _mm256_blend_epi32(_mm256_min_epu32(l, pl), _mm256_max_epu32(l, pl),
+                           0xF0);
+    h = _mm256_blend_epi32(_mm256_min_epu32(h, ph), _mm256_max_epu32(h, ph),
+                           0xF0);
+
+    pl = _mm256_shuffle_epi32(l, _MM_SHUFFLE(1, 0, 3, 2));
+    ph = _mm256_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2));
+    l = _mm256_blend_epi32(_mm256_min_epu32(l, pl), _mm256_max_epu32(l, pl),
+                           0xCC);
+    h = _mm256_blend_epi32(_mm256_min_epu32(h, ph), _mm256_max_epu32(h, ph),
+                           0xCC);
+
+    pl = _mm256_shuffle_epi32(l, _MM_SHUFFLE(2, 3, 0, 1));
+    ph = _mm256_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1));
+    l = _mm256_blend_epi32(_mm256_min_epu32(l, pl), _mm256_max_epu32(l, pl),
+                           0xAA);
+    h = _mm256_blend_epi32(_mm256_min_epu32(h, ph), _mm256_max_epu32(h, ph),
+                           0xAA);
+
+    *lo = l;
+    *hi = h;
+}
+
+/*!
+    The same network four lanes wide: distances 2 and 1 only.
+*/
+
+__attribute__((target("sse4.1")))
+inline void
+bitonic_sse41(__m128i *lo, __m128i *hi)
+{
+    const __m128i b = _mm_shuffle_epi32(*hi, _MM_SHUFFLE(0, 1, 2, 3));
+    __m128i l = _mm_min_epu32(*lo, b);
+    __m128i h = _mm_max_epu32(*lo, b);
+    __m128i pl, ph;
+
+    pl = _mm_shuffle_epi32(l, _MM_SHUFFLE(1, 0, 3, 2));
+    ph = _mm_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2));
+    l = _mm_blend_epi16(_mm_min_epu32(l, pl), _mm_max_epu32(l, pl), 0xF0);
+    h = _mm_blend_epi16(_mm_min_epu32(h, ph), _mm_max_epu32(h, ph), 0xF0);
+
+    pl = _mm_shuffle_epi32(l, _MM_SHUFFLE(2, 3, 0, 1));
+    ph = _mm_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1));
+    l = _mm_blend_epi16(_mm_min_epu32(l, pl), _mm_max_epu32(l, pl), 0xCC);
+    h = _mm_blend_epi16(_mm_min_epu32(h, ph), _mm_max_epu32(h, ph), 0xCC);
+
+    *lo = l;
+    *hi = h;
+}
+
+#endif
+
+/*!
+    Co-ranking, or the merge path: the first 'k' values of merging
+    sorted a[0..la) and b[0..lb) are a[0..*ia) and b[0..*ib), ties
+    going to 'a'.  A binary search, so it's cheap to cut one merge into
+    slices that can be done separately.  Returns 'k'.
+
+    The vector kernels use it too: they stop with 'k' values written
+    and the biggest vector's worth of what they loaded still in a
+    register, and this works out where in 'a' and 'b' that leaves them.
+*/
+
+template <class T, class Less>
+unsigned int
+co_rank
+(
+    const T *a,
+    unsigned int la,
+    const T *b,
+    unsigned int lb,
+    unsigned int k,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    *ia = *ib = 0;
+    if (!k)
+        return 0;
+
+    // the usual merge path search: the split where nothing taken is
+    // bigger than anything left, ties going to 'a'
+    const unsigned int a_all = std::min(la, k);
+    unsigned int lo = k > lb ? k - lb : 0, hi = a_all;
+    while (lo < hi)
+    {
+        const unsigned int i = (lo + hi) / 2;
+        if (Less()(b[k - i - 1], a[i]))         // too much of 'a'
+            hi = i;
+        else
+            lo = i + 1;
+    }
+    *ia = lo;
+    *ib = k - lo;
+    return k;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*!
+    merge_kernel_t with AVX2: eight values out per round.  Each round
+    loads the next eight from whichever side's next value is smaller,
+    which is what guarantees the eight smallest left are all in hand.
+*/
+
+__attribute__((target("avx2")))
+unsigned int
+merge_avx2
+(
+    const data_t *a,
+    unsigned int la,
+    const data_t *b,
+    unsigned int lb,
+    data_t *out,
+    unsigned int room,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    const unsigned int W = 8;
+
+    *ia = *ib = 0;
+    if (la < W || lb < W || room < W)
+        return 0;
+
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+    unsigned int pa = W, pb = W, k = 0;
+
+    for (;;)
+    {
+        bitonic_avx2(&lo, &hi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), lo);
+        k += W;
+
+        if (room - k < W)
+            break;
+
+        if (pa < la && (pb == lb || !(b[pb] < a[pa])))
+        {
+            if (la - pa < W)
+                break;
+            lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + pa));
+            pa += W;
+        } else if (pb < lb)
+        {
+            if (lb - pb < W)
+                break;
+            lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + pb));
+            pb += W;
+        } else
+            break;
+    }
+    return co_rank<data_t, std::less<data_t> >(a, pa, b, pb, k, ia, ib);
+}
+
+/*!
+    merge_kernel_t with SSE4.1: four values out per round.
+*/
+
+__attribute__((target("sse4.1")))
+unsigned int
+merge_sse41
+(
+    const data_t *a,
+    unsigned int la,
+    const data_t *b,
+    unsigned int lb,
+    data_t *out,
+    unsigned int room,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    const unsigned int W = 4;
+
+    *ia = *ib = 0;
+    if (la < W || lb < W || room < W)
+        return 0;
+
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+    unsigned int pa = W, pb = W, k = 0;
+
+    for (;;)
+    {
+        bitonic_sse41(&lo, &hi);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + k), lo);
+        k += W;
+
+        if (room - k < W)
+            break;
+
+        if (pa < la && (pb == lb || !(b[pb] < a[pa])))
+        {
+            if (la - pa < W)
+                break;
+            lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + pa));
+            pa += W;
+        } else if (pb < lb)
+        {
+            if (lb - pb < W)
+                break;
+            lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + pb));
+            pb += W;
+        } else
+            break;
+    }
+    return co_rank<data_t, std::less<data_t> >(a, pa, b, pb, k, ia, ib);
+}
+
+#endif
+
+/*!
+    merge_kernel_t in plain C++, one value at a time, without a branch
+    on the comparison: the loser's index just doesn't move.  On random
+    keys the 'if' in the usual merge loop guesses wrong half the time,
+    and that was most of what the merge cost.  Ties go to 'a'.
+*/
+
+template <class T, class Less>
+unsigned int
+merge_branchless
+(
+    const T *a,
+    unsigned int la,
+    const T *b,
+    unsigned int lb,
+    T *out,
+    unsigned int room,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    const Less less;
+    unsigned int i = 0, j = 0, k = 0;
+
+    // however it goes, this many steps can't run off the end of
+    // anything: saves checking all three ends every time round
+    unsigned int steps;
+    while ((steps = std::min(std::min(la - i, lb - j), room - k)))
+    {
+        while (steps--)
+        {
+            const T x = a[i];
+            const T y = b[j];
+            const unsigned int take_b = less(y, x);
+
+            out[k++] = take_b ? y : x;
+            i += take_b ^ 1;
+            j += take_b;
+        }
+    }
+    *ia = i;
+    *ib = j;
+    return k;
+}
+
+/*!
+    The widest merge kernel this CPU can run, or none when only the
+    scalar one will do.  Sets 'name' to say which.
+*/
+
+merge_kernel_t
+pick_merge_kernel(const char **name)
+{
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return merge_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        *name = "sse4.1";
+        return merge_sse41;
+    }
+#endif
+    *name = "scalar";
+    return 0;
+}
+
+/*!
+    The merge_kernel, for records it knows how to do: it only comes
+    for plain data_t in ascending order.  Everything else is merged by
+    merge_branchless() alone, so this just says nothing got done.
+*/
+
+template <class T, class Less>
+unsigned int
+vector_merge
+(
+    const T *,
+    unsigned int,
+    const T *,
+    unsigned int,
+    T *,
+    unsigned int,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    *ia = *ib = 0;
+    return 0;
+}
+
+template <>
+unsigned int
+vector_merge<data_t, std::less<data_t> >
+(
+    const data_t *a,
+    unsigned int la,
+    const data_t *b,
+    unsigned int lb,
+    data_t *out,
+    unsigned int room,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    *ia = *ib = 0;
+    if (!merge_kernel)
+        return 0;
+    return merge_kernel(a, la, b, lb, out, room, ia, ib);
+}
+
+/*!
+    Under '-M' the kernels still get to merge: they're counted as the
+    one comparison a value that the scalar merge would have made.
+*/
+
+template <>
+unsigned int
+vector_merge<data_t, counted_less<std::less<data_t> > >
+(
+    const data_t *a,
+    unsigned int la,
+    const data_t *b,
+    unsigned int lb,
+    data_t *out,
+    unsigned int room,
+    unsigned int *ia,
+    unsigned int *ib
+)
+{
+    const unsigned int k = vector_merge<data_t, std::less<data_t> >(
+        a, la, b, lb, out, room, ia, ib);
+    compare_count::asked.fetch_add(k, std::memory_order_relaxed);
+    return k;
+}
+
+/*!
+    How many values from the start of 'a' are in ascending order: the
+    part of the current run that a merge kernel can be let loose on.
+*/
+
+template <class T, class Less>
+unsigned int
+run_extent(const T *a, unsigned int length)
+{
+    unsigned int i = 1;
+    while (i < length && !plain_t<Less>()(a[i], a[i - 1]))
+        ++i;
+    return std::min(i, length);
+}
+
+/*!
+    Merges all of sorted a[0..la) and b[0..lb) into 'out', which has
+    room for the lot.  Ties go to 'a'.
+*/
+
+template <class T, class Less>
+void
+merge_all
+(
+    const T *a,
+    unsigned int la,
+    const T *b,
+    unsigned int lb,
+    T *out
+)
+{
+    const unsigned int length = la + lb;
+    unsigned int i, j;
+    unsigned int k = vector_merge<T, Less>(a, la, b, lb, out, length, &i, &j);
+
+    unsigned int di, dj;
+    k += merge_branchless<T, Less>(a + i, la - i, b + j, lb - j,
+                                   out + k, length - k, &di, &dj);
+    i += di;
+    j += dj;
+
+    // one side is used up: the rest of the other goes on the end
+    copy_records(a + i, la - i, out + k);
+    copy_records(b + j, lb - j, out + k + (la - i));
+}
+
+/*!
+    Where each run in a[0..length) starts, with 'length' on the end so
+    run r is always [starts[r], starts[r + 1]).
+*/
+
+template <class T, class Less>
+void
+run_starts
+(
+    const T *a,
+    unsigned int length,
+    std::vector<unsigned int> *starts
+)
+{
+    starts->clear();
+    if (length)
+        starts->push_back(0);
+    for (unsigned int i = 1; i < length; ++i)
+    {
+        if (plain_t<Less>()(a[i], a[i - 1]))
+            starts->push_back(i);
+    }
+    starts->push_back(length);
+}
+
+/*!
+    Copies the rest of the current run on 's' to 'd'.  A run ends where
+    the next value on the tape is smaller than the last one read.
+
+    Works a span at a time, so only the run check is left per value.
+    Returns the number of values copied.
+*/
+
+template <class T, class Less>
+unsigned int
+copy_run(tape_t<T, Less> *s, tape_t<T, Less> *d)
+{
+    unsigned int length = 0;
+    bool more = !is_end(s);
+
+    while (more)
+    {
+        unsigned int in, room;
+        const T *a = s->read_span(&in);
+        T *out = d->write_span(&room);
+        const unsigned int most = std::min(in, room);
+
+        unsigned int i = 1;
+        while (i < most && !plain_t<Less>()(a[i], a[i - 1]))
+            ++i;
+
+        copy_records(a, i, out);
+        const T last = a[i - 1];
+        d->commit(i);
+        s->skip(i);
+        length += i;
+
+        more = !is_end(s) && !plain_t<Less>()(s->front(), last);
+    }
+    return length;
+}
+
+/*!
+    Merges the current run on 's1' with the current run on 's2' into a
+    single run on 'd'.  Ties go to 's1', so equal keys keep their order.
+
+    The inner loop works on spans: it only stops to go back to the
+    tapes when one of the spans is used up or one of the runs ends.
+    The part of each run that's in the spans goes through
+    vector_merge() a vector at a time, if the records are ones the
+    merge_kernel can do, and merge_branchless() does whatever is left
+    over.
+*/
+
+template <class T, class Less>
+void
+merge_run(tape_t<T, Less> *s1, tape_t<T, Less> *s2, tape_t<T, Less> *d)
+{
+    bool more1 = !is_end(s1);
+    bool more2 = !is_end(s2);
+
+    while (more1 && more2)
+    {
+        unsigned int length1, length2, room;
+        const T *a = s1->read_span(&length1);
+        const T *b = s2->read_span(&length2);
+        T *out = d->write_span(&room);
+
+        const unsigned int extent1 = run_extent<T, Less>(a, length1);
+        const unsigned int extent2 = run_extent<T, Less>(b, length2);
+        unsigned int i, j;
+        unsigned int k = vector_merge<T, Less>(a, extent1, b, extent2,
+                                               out, room, &i, &j);
+
+        unsigned int di, dj;
+        k += merge_branchless<T, Less>(a + i, extent1 - i, b + j, extent2 - j,
+                                       out + k, room - k, &di, &dj);
+        i += di;
+        j += dj;
+
+        // all of a run used up, with the next run in the same span
+        bool end1 = i == extent1 && extent1 < length1;
+        bool end2 = j == extent2 && extent2 < length2;
+
+        // skip() may hand the spans back for refilling: keep what's needed
+        const bool check1 = i && !end1 && i == length1;
+        const bool check2 = j && !end2 && j == length2;
+        const T last1 = check1 ? a[i - 1] : T();
+        const T last2 = check2 ? b[j - 1] : T();
+
+        d->commit(k);
+        s1->skip(i);
+        s2->skip(j);
+
+        // a run that got to the end of its span may go on in the next
+        if (check1)
+            end1 = is_end(s1) || plain_t<Less>()(s1->front(), last1);
+        if (check2)
+            end2 = is_end(s2) || plain_t<Less>()(s2->front(), last2);
+        more1 = !end1;
+        more2 = !end2;
+    }
+
+    if (more1)
+        copy_run(s1, d);
+    else if (more2)
+        copy_run(s2, d);
+}
+
+/*!
+    One pass over all n elements: pairs up the runs on 's1' and 's2'
+    and lays the merged runs alternately onto 'd1' and 'd2'.  Whichever
+    source has runs left over once the other is dry just gets its runs
+    copied across.
+
+    Returns the number of runs written, which is at most half of what
+    the sources held (rounded up), plus one if they were lopsided.
+*/
+
+template <class T, class Less>
+unsigned int
+merge_pass
+(
+    tape_t<T, Less> *s1,
+    tape_t<T, Less> *s2,
+    tape_t<T, Less> *d1,
+    tape_t<T, Less> *d2
+)
+{
+    tape_t<T, Less> *to_write = d1;
+    unsigned int runs = 0;
+
+    while (!is_end(s1) || !is_end(s2))
+    {
+        merge_run(s1, s2, to_write);
+        to_write = (to_write == d1 ? d2 : d1);
+        ++runs;
+    }
+    return runs;
+}
+
+/*!
+    Merges the part [begin, end) of what merging sorted a[0..la) and
+    b[0..lb) would give into out[begin..end).
+*/
+
+template <class T, class Less>
+void
+merge_slice
+(
+    const T *a,
+    unsigned int la,
+    const T *b,
+    unsigned int lb,
+    T *out,
+    unsigned int begin,
+    unsigned int end
+)
+{
+    if (!begin && end == la + lb)
+    {
+        merge_all<T, Less>(a, la, b, lb, out);
+        return;
+    }
+
+    unsigned int i0, j0, i1, j1;
+    co_rank<T, Less>(a, la, b, lb, begin, &i0, &j0);
+    co_rank<T, Less>(a, la, b, lb, end, &i1, &j1);
+    merge_all<T, Less>(a + i0, i1 - i0, b + j0, j1 - j0, out + begin);
+}
+
+/*!
+    'base' has the buffers of all four tapes, each big enough for all n
+    values.  Pairs go out in tasks of about 'grain' values.
+*/
+
+template <class T, class Less>
+merge_plan<T, Less>::merge_plan(T **base, unsigned int grain, bool streamed)
+    : base_(base), grain_(grain), first_merge_(streamed ? 1 : 0),
+      final_(~0u)
+{
+    open_level(0, 1);
+    if (streamed)
+        open_level(2, 3);
+}
+
+template <class T, class Less>
+merge_plan<T, Less>::~merge_plan()
+{
+}
+
+/*!
+    A run of 'length' values has been written after the others on
+    'side' of the starting level (the input, or what make_runs() is
+    writing).
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::add_run(unsigned int side, unsigned int length)
+{
+    level_tape *t = &levels_[first_merge_].side[side];
+    const T *d = base_[t->tape] + t->length;
+
+    run_piece piece;
+    piece.offset = t->length;
+    piece.length = length;
+    piece.first = d[0];
+    piece.last = d[length - 1];
+    piece.made_from = piece.made_to = 0;
+    add_piece(t, piece);
+    pump();
+}
+
+/*!
+    No more runs are coming.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::close_level()
+{
+    close_sides(&levels_[first_merge_]);
+    pump();
+}
+
+/*!
+    Whatever's reading the input (make_runs(), that is) is done with
+    the first 'covered' values on 'side': they can be written over.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::input_read(unsigned int side, unsigned int covered)
+{
+    cover(&levels_[0].side[side], covered, false);
+}
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::input_done()
+{
+    for (unsigned int s = 0; s < 2; ++s)
+        cover(&levels_[0].side[s], levels_[0].side[s].length, true);
+}
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::open_level(unsigned int tape1, unsigned int tape2)
+{
+    levels_.push_back(level());
+    level &l = levels_.back();
+    for (unsigned int s = 0; s < 2; ++s)
+    {
+        level_tape &t = l.side[s];
+        t.tape = s ? tape2 : tape1;
+        t.is_open = false;
+        t.length = 0;
+        t.closed = false;
+        t.covered = 0;
+        t.all_read = false;
+    }
+    l.state = UNKNOWN;
+    l.pairs = 0;
+    l.consumed = false;
+    l.batch = 0;
+}
+
+/*!
+    Puts 'piece' on the end of 't': it carries on the run that's there
+    unless it starts lower than that finished.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::add_piece(level_tape *t, const run_piece &piece)
+{
+    if (t->is_open && !plain_t<Less>()(piece.first, t->open.last))
+    {
+        t->open.length += piece.length;
+        t->open.last = piece.last;
+        t->open.made_to = piece.made_to;
+    } else
+    {
+        if (t->is_open)
+            t->runs.push_back(t->open);
+        t->open = piece;
+        t->is_open = true;
+    }
+    t->length += piece.length;
+}
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::close_sides(level *l)
+{
+    for (unsigned int s = 0; s < 2; ++s)
+    {
+        level_tape &t = l->side[s];
+        if (t.is_open)
+            t.runs.push_back(t.open);
+        t.is_open = false;
+        t.closed = true;
+    }
+}
+
+/*!
+    is_sorted(), as far as what's known of the level goes.  A descent
+    anywhere settles it; otherwise it takes the whole level.  Only ever
+    asked before any of the level's runs are paired off.
+*/
+
+template <class T, class Less>
+typename merge_plan<T, Less>::level_state
+merge_plan<T, Less>::judge(const level &l) const
+{
+    for (unsigned int s = 0; s < 2; ++s)
+    {
+        if (l.side[s].runs.size() + l.side[s].is_open >= 2)
+            return UNSORTED;
+    }
+    if (!l.side[0].closed || !l.side[1].closed)
+        return UNKNOWN;
+
+    const level_tape &t1 = l.side[0];
+    const level_tape &t2 = l.side[1];
+    if (t1.runs.empty() || t2.runs.empty())
+        return SORTED;
+    return plain_t<Less>()(t2.runs[0].first, t1.runs[0].last) ? UNSORTED
+                                                              : SORTED;
+}
+
+/*!
+    Forms every pair that can be formed yet, level by level, the way
+    merge_pass() would: run i of each side of a level, or the one that
+    has a run i, merged onto side i % 2 of the next.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::pump()
+{
+    for (unsigned int l = first_merge_; l < levels_.size(); ++l)
+    {
+        level &from = levels_[l];
+        if (from.state == UNKNOWN)
+            from.state = judge(from);
+        if (from.state == SORTED)
+        {
+            final_ = l;
+            break;
+        }
+        if (from.state == UNKNOWN || from.consumed)
+            continue;
+
+        if (l + 1 == levels_.size())
+            open_level(from.side[0].tape ^ 2, from.side[1].tape ^ 2);
+
+        for (;;)
+        {
+            const run_piece *r[2];
+            bool ready = true;
+            for (unsigned int s = 0; s < 2; ++s)
+            {
+                const level_tape &t = from.side[s];
+                r[s] = t.runs.empty() ? 0 : &t.runs.front();
+                if (!r[s] && !t.closed)
+                    ready = false;
+            }
+            if (!ready)
+                break;
+
+            if (!r[0] && !r[1])
+            {
+                // that's the lot: everything on the next level is known
+                from.consumed = true;
+                if (from.batch)
+                    release(from.batch);
+                from.batch = 0;
+                for (unsigned int s = 0; s < 2; ++s)
+                    cover(&from.side[s], from.side[s].length, true);
+                close_sides(&levels_[l + 1]);
+                break;
+            }
+            add_pair(l, r[0], r[1]);
+            for (unsigned int s = 0; s < 2; ++s)
+            {
+                if (r[s])
+                    from.side[s].runs.pop_front();
+            }
+        }
+    }
+}
+
+/*!
+    Pair number levels_[l].pairs: run 'r1' from side 0 of level 'l' and
+    'r2' from side 1, either of which might be missing.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::add_pair
+(
+    unsigned int l,
+    const run_piece *r1,
+    const run_piece *r2
+)
+{
+    level &from = levels_[l];
+    const unsigned int side = from.pairs & 1;
+    level_tape &to = levels_[l + 1].side[side];
+
+    typename merge_task<T>::pair_io io;
+    io.a = r1 ? base_[from.side[0].tape] + r1->offset : 0;
+    io.la = r1 ? r1->length : 0;
+    io.b = r2 ? base_[from.side[1].tape] + r2->offset : 0;
+    io.lb = r2 ? r2->length : 0;
+    io.out = base_[to.tape] + to.length;
+
+    const unsigned int size = io.la + io.lb;
+    run_piece piece;
+    piece.offset = to.length;
+    piece.length = size;
+    piece.first = !r1 ? r2->first : !r2 ? r1->first
+                : std::min(r1->first, r2->first, plain_t<Less>());
+    piece.last = !r1 ? r2->last : !r2 ? r1->last
+               : std::max(r1->last, r2->last, plain_t<Less>());
+
+    if (size > grain_)
+    {
+        // big: slices of it, each a task of its own
+        if (from.batch)
+            release(from.batch);
+        from.batch = 0;
+        piece.made_from = from.tasks.size();
+
+        const unsigned int slices = (size + grain_ - 1) / grain_;
+        for (unsigned int i = 0; i < slices; ++i)
+        {
+            merge_task<T> *task = new_task(l);
+            io.begin = unsigned(size_t(size) * i / slices);
+            io.end = unsigned(size_t(size) * (i + 1) / slices);
+            task->pairs.push_back(io);
+            task->size = io.end - io.begin;
+            hook_up(l, task, r1, r2, side, piece);
+            release(task);
+        }
+    } else
+    {
+        // small: in with the other small ones
+        if (!from.batch)
+            from.batch = new_task(l);
+        piece.made_from = from.tasks.size() - 1;
+        merge_task<T> *task = from.batch;
+        io.begin = 0;
+        io.end = size;
+        task->pairs.push_back(io);
+        task->size += size;
+        hook_up(l, task, r1, r2, side, piece);
+        if (task->size >= grain_)
+        {
+            release(task);
+            from.batch = 0;
+        }
+    }
+
+    piece.made_to = from.tasks.size();
+    ++from.pairs;
+    for (unsigned int s = 0; s < 2; ++s)
+    {
+        level_tape &t = from.side[s];
+        const run_piece *r = s ? r2 : r1;
+        if (r)
+            cover(&t, r->offset + r->length, false);
+    }
+    add_piece(&to, piece);
+}
+
+/*!
+    What 'task', reading runs 'r1' and 'r2' off level 'l' and writing
+    'piece' onto 'side' of the next level, has to wait for: whatever
+    writes those runs, and whatever still reads the tape where 'piece'
+    goes, on any of the older levels that tape has held.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::hook_up
+(
+    unsigned int l,
+    merge_task<T> *task,
+    const run_piece *r1,
+    const run_piece *r2,
+    unsigned int side,
+    const run_piece &piece
+)
+{
+    level &from = levels_[l];
+    for (unsigned int s = 0; s < 2; ++s)
+    {
+        const run_piece *r = s ? r2 : r1;
+        if (!r)
+            continue;
+        for (unsigned int i = r->made_from; i < r->made_to; ++i)
+            depend(task, &levels_[l - 1].tasks[i]);
+
+        std::vector<reader> &read_by = from.side[s].read_by;
+        if (read_by.empty() || read_by.back().task != task)
+        {
+            const reader me = { r->offset, r->offset + r->length, task };
+            read_by.push_back(me);
+        } else
+            read_by.back().end = r->offset + r->length;
+    }
+
+    // the same tape was side 'side' of levels l - 1, l - 3, ...
+    for (int older = int(l) - 1; older >= 0; older -= 2)
+        wait_for_readers(&levels_[older].side[side], piece.offset,
+                         piece.offset + piece.length, task);
+}
+
+/*!
+    The readers of 't' are known up to 'covered' ('all' of them, if
+    that's all there will be).  Writers waiting on that can get their
+    dependencies filled in.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::cover(level_tape *t, unsigned int covered, bool all)
+{
+    t->covered = covered;
+    t->all_read = all;
+
+    std::vector<parked> &w = t->writers;
+    while (!w.empty() && (all || w.front().end <= covered))
+    {
+        std::pop_heap(w.begin(), w.end(), std::greater<parked>());
+        const parked p = w.back();
+        w.pop_back();
+        wait_for_readers(t, p.begin, p.end, p.task);
+        release(p.task);
+    }
+}
+
+/*!
+    Makes 'task' wait for every reader of [begin, end) on 't', or parks
+    it (holding it back) until those readers are all known.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::wait_for_readers
+(
+    level_tape *t,
+    unsigned int begin,
+    unsigned int end,
+    merge_task<T> *task
+)
+{
+    if (!t->all_read && t->covered < end)
+    {
+        ++task->waiting;
+        const parked w = { begin, end, task };
+        t->writers.push_back(w);
+        std::push_heap(t->writers.begin(), t->writers.end(),
+                       std::greater<parked>());
+        return;
+    }
+
+    // readers are in order: the first that ends after 'begin' on
+    std::vector<reader> &r = t->read_by;
+    unsigned int lo = 0, hi = r.size();
+    while (lo < hi)
+    {
+        const unsigned int mid = (lo + hi) / 2;
+        if (r[mid].end <= begin)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (unsigned int i = lo; i < r.size() && r[i].begin < end; ++i)
+    {
+        if (r[i].task != task)
+            depend(task, r[i].task);
+    }
+}
+
+template <class T, class Less>
+merge_task<T> *
+merge_plan<T, Less>::new_task(unsigned int l)
+{
+    levels_[l].tasks.emplace_back();
+    return &levels_[l].tasks.back();
+}
+
+/*!
+    'task' can't go until 'on' is done.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::depend(merge_task<T> *task, merge_task<T> *on)
+{
+    std::lock_guard<std::mutex> guard(graph_);
+    if (on->done || (!on->next.empty() && on->next.back() == task))
+        return;
+    on->next.push_back(task);
+    ++task->waiting;
+}
+
+/*!
+    One less thing for 'task' to wait for: if that was the last, it's
+    off to the pool.
+*/
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::release(merge_task<T> *task)
+{
+    if (!--task->waiting)
+        pool->spawn([this, task] { run(task); });
+}
+
+template <class T, class Less>
+void
+merge_plan<T, Less>::run(merge_task<T> *task)
+{
+    for (unsigned int i = 0; i < task->pairs.size(); ++i)
+    {
+        const typename merge_task<T>::pair_io &io = task->pairs[i];
+        merge_slice<T, Less>(io.a, io.la, io.b, io.lb, io.out,
+                             io.begin, io.end);
+    }
+
+    std::vector<typename merge_task<T>::pair_io>().swap(task->pairs);
+
+    std::vector<merge_task<T> *> next;
+    {
+        std::lock_guard<std::mutex> guard(graph_);
+        task->done = true;
+        next.swap(task->next);
+    }
+    for (unsigned int i = 0; i < next.size(); ++i)
+        release(next[i]);
+}
+
+/*!
+    Replacement selection: the general version of tm2's three-slot
+    sort_3() window.  Keeps 'size' values in a heap, always writes out
+    the smallest one that can still extend the current run, and tags
+    anything smaller than what was just written for the next run.
+
+    On random input the runs come out about twice 'size' long; already
+    sorted input comes out as a single run.  Runs go alternately onto
+    'd1' and 'd2', ready for merge_pass(), and 'finished' (if there is
+    one) hears about each as it's done.  Returns the number of runs.
+*/
+
+template <class T, class Less>
+unsigned int
+make_runs
+(
+    tape_t<T, Less> *s1,
+    tape_t<T, Less> *s2,
+    tape_t<T, Less> *d1,
+    tape_t<T, Less> *d2,
+    unsigned int size,
+    const run_hook_t *finished
+)
+{
+    assert(size);
+
+    const run_key_greater<T, Less> later;
+    std::vector<run_key_t<T> > heap;
+    heap.reserve(size);
+
+    T d;
+    while (heap.size() < size && read(s1, s2, &d))
+        heap.push_back(run_key_t<T>(0, d));
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    tape_t<T, Less> *to_write = d1;
+    unsigned int run = 0;
+    unsigned int length = 0;
+
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        const run_key_t<T> smallest = heap.back();
+        heap.pop_back();
+
+        if (smallest.first != run)
+        {
+            // nothing left that fits this run: start the next one on
+            // the other tape
+            if (finished)
+                (*finished)(to_write == d1 ? 0 : 1, length);
+            run = smallest.first;
+            to_write = (to_write == d1 ? d2 : d1);
+            length = 0;
+        }
+        to_write->put(smallest.second);
+        ++length;
+
+        if (read(s1, s2, &d))
+        {
+            const bool next = Less()(d, smallest.second);
+            heap.push_back(run_key_t<T>(next ? run + 1 : run, d));
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    }
+    if (finished && length)
+        (*finished)(to_write == d1 ? 0 : 1, length);
+    return run + 1;
+}
+
+/*!
+    sort_natural() as a merge_plan<T, Less> on the worker pool.  The tapes all
+    end up the way sort_natural() leaves them, and it prints the same.
+
+    With '-b', make_runs() runs on this thread and hands each run to
+    the plan as it finishes, so the pool is already merging the first
+    runs while the rest are being made; the plan holds back anything
+    that would write over input make_runs() hasn't read yet.
+*/
+
+template <class T, class Less>
+void
+sort_natural_tasks
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    tape_t<T, Less> *tapes[4] = { t1, t2, t3, t4 };
+    const bool streamed = run_buffer && !is_sorted(t1, t2);
+
+    T *base[4];
+    for (unsigned int i = 0; i < 4; ++i)
+        base[i] = tapes[i]->buffer(n);
+
+    const unsigned int grain = std::max(n / (4 * pool->size()), 4096u);
+    merge_plan<T, Less> plan(base, grain, streamed);
+
+    unsigned int count = 0;
+    if (streamed)
+    {
+        const unsigned int size1 = t1->size();
+        const unsigned int size2 = t2->size();
+        const run_hook_t finished = [&](unsigned int side,
+                                        unsigned int length)
+        {
+            plan.input_read(0, size1 - t1->size());
+            plan.input_read(1, size2 - t2->size());
+            plan.add_run(side, length);
+        };
+
+        unsigned int runs = make_runs(t1, t2, t3, t4, run_buffer, &finished);
+        cout << "Pass " << count << ": " << runs
+             << " runs from replacement selection\n";
+        ++count;
+
+        plan.input_done();
+        plan.close_level();
+    } else
+    {
+        std::vector<unsigned int> starts;
+        for (unsigned int s = 0; s < 2; ++s)
+        {
+            run_starts<T, Less>(base[s], tapes[s]->size(), &starts);
+            for (unsigned int r = 0; r + 1 < starts.size(); ++r)
+                plan.add_run(s, starts[r + 1] - starts[r]);
+        }
+        plan.close_level();
+    }
+
+    pool->wait();
+
+    const unsigned int last = plan.last_level();
+    for (unsigned int l = plan.first_pass(); l < last; ++l, ++count)
+        cout << "Pass " << count << ": " << plan.pairs(l) << " runs\n";
+
+    // the sorted level's tapes hold what it says; the others are empty
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        unsigned int length = 0;
+        for (unsigned int s = 0; s < 2; ++s)
+        {
+            if (plan.tape(last, s) == i)
+                length = plan.length(last, s);
+        }
+        tapes[i]->hold(length);
+    }
+    end_pass("task graph", count);
+
+    cout << "\n\nIn " << count << " passes: ";
+    print(tapes[plan.tape(last, 0)], tapes[plan.tape(last, 1)]);
+    cout << "\n\n\n";
+}
+
+/*!
+    Natural merge sort.  Nothing assumes the input is random: the first
+    pass treats whatever ascending runs are already on t1 and t2 as its
+    starting runs and distributes the merged pairs onto t3 and t4.
+    Every pass after that at least halves the number of runs, so it
+    takes O(log(runs)) passes, and input that is already mostly sorted
+    finishes in a couple.
+
+    With '-b size', the first pass is make_runs() instead, which makes
+    the starting runs longer than the input's own at the cost of 'size'
+    values' worth of memory.
+
+    Runs don't split evenly between tapes, so unlike the classic engine
+    this doesn't hold each tape to n / 2: a real tape would just need to
+    be long enough to take all of them.
+
+    With '-j' and the tapes in memory (or mapped), it's all handed to
+    sort_natural_tasks() instead.
+*/
+
+template <class T, class Less>
+void
+sort_natural
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    if (pool && t1->random_access() && t3->random_access())
+    {
+        sort_natural_tasks(t1, t2, t3, t4);
+        return;
+    }
+
+    tape_t<T, Less> *source1 = t1;
+    tape_t<T, Less> *source2 = t2;
+    tape_t<T, Less> *dest1 = t3;
+    tape_t<T, Less> *dest2 = t4;
+
+    unsigned int count = 0;
+    if (run_buffer && !is_sorted(source1, source2))
+    {
+        unsigned int runs = make_runs(source1, source2, dest1, dest2,
+                                      run_buffer);
+        cout << "Pass " << count << ": " << runs
+             << " runs from replacement selection\n";
+
+        std::swap(source1, dest1);
+        std::swap(source2, dest2);
+
+        rewind(source1);
+        rewind(source2);
+        rewind(dest1);
+        rewind(dest2);
+        ++count;
+        end_pass("runs");
+    }
+
+    while (!is_sorted(source1, source2))
+    {
+        unsigned int runs = merge_pass(source1, source2, dest1, dest2);
+        cout << "Pass " << count << ": " << runs << " runs\n";
+
+        // source tapes are empty: switch source and dest pointers
+        std::swap(source1, dest1);
+        std::swap(source2, dest2);
+
+        rewind(source1);
+        rewind(source2);
+        rewind(dest1);
+        rewind(dest2);
+        ++count;
+        end_pass("merge");
+    }
+
+    cout << "\n\nIn " << count << " passes: ";
+    print(source1, source2);
+    cout << "\n\n\n";
+}
+
+/*!
+    Algorithm D's "level up" for three input tapes: the next perfect
+    Fibonacci distribution after (a, b, c) is (a + b, a + c, a), and
+    whatever that adds to each tape is owed as dummy runs until real
+    ones are written in their place.
+*/
+
+template <class T, class Less>
+void
+next_level(unsigned int *a, phase_tape<T, Less> *p)
+{
+    const unsigned int next[3] = { a[0] + a[1], a[0] + a[2], a[0] };
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        p[i].dummies += next[i] - a[i];
+        a[i] = next[i];
+    }
+}
+
+/*!
+    Deals the natural runs of t1 then t2 out onto p[0..2] in a Fibonacci
+    distribution (Knuth's Algorithm D, 5.4.2): each run goes to the tape
+    that is owed the most, and when nobody is owed anything the target
+    moves up a level.  Whatever is still owed at the end stays behind
+    as dummy runs.
+
+    p[2] is t1 itself, so it can't take runs until the input has been
+    read off it.  Until then the runs go to p[0] and p[1] only, and p[2]
+    just carries its share as dummies.
+*/
+
+template <class T, class Less>
+void
+distribute_runs
+(
+    tape_t<T, Less> *s1,
+    tape_t<T, Less> *s2,
+    phase_tape<T, Less> *p
+)
+{
+    assert(p[2].tape == s1);
+
+    unsigned int a[3] = { 1, 1, 1 };
+    for (unsigned int i = 0; i < 3; ++i)
+        p[i].dummies = a[i];
+
+    tape_t<T, Less> *in = s1;
+    unsigned int open = 2;              // tapes able to take a run
+
+    for (;;)
+    {
+        if (is_end(in))
+        {
+            if (in == s2)
+                break;
+
+            // t1 is read through: it's free to be written from the top
+            in = s2;
+            rewind(s1);
+            open = 3;
+            continue;
+        }
+
+        int j = -1;
+        for (unsigned int i = 0; i < open; ++i)
+        {
+            if (p[i].dummies && (j < 0 || p[i].dummies > p[j].dummies))
+                j = i;
+        }
+
+        if (j < 0)
+        {
+            next_level(a, p);
+            continue;
+        }
+
+        --p[j].dummies;
+        p[j].runs.push_back(copy_run(in, p[j].tape));
+    }
+}
+
+/*!
+    Merges the next 'length[i]' values of each in[i] into one run on
+    'd'.  A zero length means that tape is sitting this one out.  Ties
+    go to the lower numbered tape.
+
+    Returns the length of the merged run.
+*/
+
+template <class T, class Less>
+unsigned int
+merge_counted
+(
+    phase_tape<T, Less> **in,
+    unsigned int *length,
+    unsigned int ways,
+    tape_t<T, Less> *d
+)
+{
+    unsigned int total = 0;
+    for (;;)
+    {
+        int j = -1;
+        for (unsigned int i = 0; i < ways; ++i)
+        {
+            if (length[i] &&
+                (j < 0 || Less()(in[i]->tape->front(), in[j]->tape->front())))
+                j = i;
+        }
+
+        if (j < 0)
+            return total;
+
+        d->put(in[j]->tape->get());
+        --length[j];
+        ++total;
+    }
+}
+
+/*!
+    One polyphase phase: merge runs from the three inputs onto 'out'
+    until one input runs dry.  Dummies are used up first, as in Knuth;
+    a merge of nothing but dummies just leaves a dummy on 'out'.
+
+    Returns the number of values written, which is usually well short
+    of n.  That's the whole point.
+*/
+
+template <class T, class Less>
+unsigned int
+merge_phase(phase_tape<T, Less> **in, phase_tape<T, Less> *out)
+{
+    unsigned int merges = ~0u;
+    for (unsigned int i = 0; i < 3; ++i)
+        merges = std::min<unsigned int>(merges,
+                                        in[i]->runs.size() + in[i]->dummies);
+
+    unsigned int moved = 0;
+    for (unsigned int m = 0; m < merges; ++m)
+    {
+        unsigned int length[3];
+        bool real = false;
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            if (in[i]->dummies)
+            {
+                --in[i]->dummies;
+                length[i] = 0;
+            } else
+            {
+                length[i] = in[i]->runs.front();
+                in[i]->runs.pop_front();
+                real = true;
+            }
+        }
+
+        if (!real)
+        {
+            ++out->dummies;
+            continue;
+        }
+
+        const unsigned int total = merge_counted(in, length, 3, out->tape);
+        out->runs.push_back(total);
+        moved += total;
+    }
+    return moved;
+}
+
+/*!
+    Polyphase merge sort.  The runs are spread over three tapes in a
+    Fibonacci distribution and merged onto the fourth; the tape that
+    runs dry becomes the next output.  Only the runs that take part in
+    a phase are moved, so a phase rewrites a fraction of the data rather
+    than all n values the way a balanced pass does.
+
+    Uses the input's natural runs ('-b' only applies to the balanced
+    engine).  Like sort_natural(), tapes aren't held to n / 2.
+*/
+
+template <class T, class Less>
+void
+sort_polyphase
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    if (is_sorted(t1, t2))
+    {
+        cout << "\n\nIn 0 passes: ";
+        print(t1, t2);
+        cout << "\n\n\n";
+        return;
+    }
+
+    phase_tape<T, Less> p[4];
+    p[0].tape = t3;
+    p[1].tape = t4;
+    p[2].tape = t1;
+    p[3].tape = t2;
+    for (unsigned int i = 0; i < 4; ++i)
+        p[i].dummies = 0;
+
+    distribute_runs(t1, t2, p);
+    rewind(t1);
+    rewind(t2);
+    rewind(t3);
+    rewind(t4);
+    end_pass("distribute");
+
+    phase_tape<T, Less> *in[3] = { &p[0], &p[1], &p[2] };
+    phase_tape<T, Less> *out = &p[3];
+
+    cout << "Distributed " << in[0]->runs.size() << "+" << in[0]->dummies
+         << ", " << in[1]->runs.size() << "+" << in[1]->dummies
+         << ", " << in[2]->runs.size() << "+" << in[2]->dummies
+         << " runs (real+dummy)\n";
+
+    unsigned int count = 0;
+    unsigned long long moves = 0;
+    for (;;)
+    {
+        unsigned int left = 0;
+        for (unsigned int i = 0; i < 3; ++i)
+            left += in[i]->runs.size() + in[i]->dummies;
+        left += out->runs.size() + out->dummies;
+        if (left <= 1)
+            break;
+
+        const unsigned int moved = merge_phase(in, out);
+        cout << "Phase " << count << ": " << moved << " values moved\n";
+        moves += moved;
+        ++count;
+
+        // whichever input ran dry is the next output; the old output
+        // gets read back from the top
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            if (!in[i]->runs.size() && !in[i]->dummies)
+            {
+                std::swap(in[i], out);
+                break;
+            }
+        }
+        rewind(out->tape);
+        for (unsigned int i = 0; i < 3; ++i)
+            rewind(in[i]->tape);
+        end_pass("phase");
+    }
+
+    // the one run left is on whichever tape has anything on it
+    tape_t<T, Less> *result = out->tape;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        if (!is_end(in[i]->tape))
+            result = in[i]->tape;
+    }
+
+    cout << moves << " values moved in all ("
+         << (n ? double(moves) / n : 0) << " passes' worth)";
+    cout << "\n\nIn " << count << " passes: ";
+    print_single(result);
+    cout << "\n\n\n";
+}
+
+/*!
+    Merges the current run on every tape in 'in' into one run on 'd'
+    through 'tree', which must have in.size() inputs.  Returns the
+    length of the merged run.
+*/
+
+template <class T, class Less>
+unsigned int
+merge_run_kway
+(
+    std::vector<tape_t<T, Less> *> &in,
+    tape_t<T, Less> *d,
+    loser_tree<T, Less> *tree
+)
+{
+    const unsigned int ways = in.size();
+    assert(tree->ways() == ways);
+
+    for (unsigned int i = 0; i < ways; ++i)
+    {
+        const bool done = is_end(in[i]);
+        tree->set(i, done ? T() : in[i]->front(), done);
+    }
+    tree->build();
+
+    unsigned int length = 0;
+    while (!tree->finished())
+    {
+        const unsigned int i = tree->winner();
+        tape_t<T, Less> *s = in[i];
+        const T x = s->get();
+        d->put(x);
+        ++length;
+
+        const bool done = is_end(s) || plain_t<Less>()(s->front(), x);
+        tree->replay(i, done ? T() : s->front(), done);
+    }
+    return length;
+}
+
+/*!
+    The k-way version of merge_pass(): merges runs across all of 'in'
+    at once and deals the merged runs round-robin onto 'out'.  Returns
+    the number of runs written.
+*/
+
+template <class T, class Less>
+unsigned int
+merge_pass_kway
+(
+    std::vector<tape_t<T, Less> *> &in,
+    std::vector<tape_t<T, Less> *> &out
+)
+{
+    loser_tree<T, Less> tree(in.size());
+    unsigned int runs = 0;
+
+    for (;;)
+    {
+        bool more = false;
+        for (unsigned int i = 0; i < in.size(); ++i)
+            more = more || !is_end(in[i]);
+        if (!more)
+            return runs;
+
+        merge_run_kway(in, out[runs % out.size()], &tree);
+        ++runs;
+    }
+}
+
+/*!
+    Balanced k-way natural merge over 'tape_count' tapes: t1..t4 plus
+    however many spares '-k' asks for.  Half the tapes are read and half
+    written each pass, so each pass cuts the number of runs by a factor
+    of tape_count / 2 rather than 2, and a loser tree keeps that down to
+    log2(tape_count / 2) comparisons per value.
+
+    The input only starts out on t1 and t2, so the first pass is a two
+    way merge that spreads its runs over all the output tapes.  An odd
+    tape out just sits idle.
+
+    t1 and t2 lead the input half and t3 and t4 the output half, so the
+    sorted run always ends up on t1 or t3, where the caller can find it
+    once the spares are gone.
+*/
+
+template <class T, class Less>
+void
+sort_kway
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    assert(tape_count >= 4);
+
+    const unsigned int half = tape_count / 2;
+    std::vector<tape_t<T, Less> > spare(tape_count - 4);
+    for (unsigned int i = 0; i < spare.size(); ++i)
+    {
+        if (tape_dir)
+            spare[i].attach(tape_dir, map_tapes, tape_depth);
+    }
+
+    std::vector<tape_t<T, Less> *> tapes;
+    tapes.push_back(t1);
+    tapes.push_back(t2);
+    for (unsigned int i = 0; i < half - 2; ++i)
+        tapes.push_back(&spare[i]);
+    tapes.push_back(t3);
+    tapes.push_back(t4);
+    for (unsigned int i = half - 2; i < spare.size(); ++i)
+        tapes.push_back(&spare[i]);
+
+    // the spares are new: sized like the rest before the first pass
+    size_tapes(tapes.data(), 2 * half);
+
+    if (is_sorted(t1, t2))
+    {
+        cout << "\n\nIn 0 passes: ";
+        print(t1, t2);
+        cout << "\n\n\n";
+        return;
+    }
+
+    std::vector<tape_t<T, Less> *> source(tapes.begin(), tapes.begin() + half);
+    std::vector<tape_t<T, Less> *> dest(tapes.begin() + half,
+                                        tapes.begin() + 2 * half);
+
+    unsigned int count = 0;
+    unsigned int runs = 0;
+    do
+    {
+        runs = merge_pass_kway(source, dest);
+        cout << "Pass " << count << ": " << runs << " runs\n";
+
+        source.swap(dest);
+        for (unsigned int i = 0; i < half; ++i)
+        {
+            rewind(source[i]);
+            rewind(dest[i]);
+        }
+        ++count;
+        end_pass("merge");
+    } while (runs > 1);
+
+    cout << "\n\nIn " << count << " passes: ";
+    print_single(source[0]);
+    cout << "\n\n\n";
+}
+
+/*!
+    Which bits of the keys on t1 and t2 aren't the same in all of them,
+    into 'vary', and (if asked) every bit any of them has, into 'top'.
+    Only memory and mapped tapes can be looked over like this without a
+    pass of their own: false for anything else.
+*/
+
+template <class T, class Less>
+bool
+key_bits
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    decltype(key_of(T())) *vary,
+    decltype(key_of(T())) *top
+)
+{
+    typedef decltype(key_of(T())) K;
+
+    if (!t1->random_access() || !t2->random_access())
+        return false;
+
+    K ors = 0, ands = ~K(0);
+    tape_t<T, Less> *tapes[2] = { t1, t2 };
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        const unsigned int size = tapes[i]->size();
+        const T *d = tapes[i]->buffer(size);
+        for (unsigned int j = 0; j < size; ++j)
+        {
+            const K key = key_of(d[j]);
+            ors |= key;
+            ands &= key;
+        }
+    }
+    *vary = ors & ~ands;
+    if (top)
+        *top = ors;
+    return true;
+}
+
+/*!
+    One pass of a radix sort: reads s1 then s2 and deals each record
+    onto d1 or d2 by 'bit' of its key, keeping the order they came in.
+    Along the way, works out 'vary' (as key_bits() does) for whatever
+    went through.  Returns how many records went onto d2.
+*/
+
+template <class T, class Less>
+unsigned int
+radix_pass
+(
+    tape_t<T, Less> *s1,
+    tape_t<T, Less> *s2,
+    tape_t<T, Less> *d1,
+    tape_t<T, Less> *d2,
+    unsigned int bit,
+    decltype(key_of(T())) *vary
+)
+{
+    typedef decltype(key_of(T())) K;
+    const unsigned int BATCH = 4096;
+
+    std::vector<T> staged(2 * BATCH);
+    tape_t<T, Less> *source[2] = { s1, s2 };
+    K ors = 0, ands = ~K(0);
+    unsigned int ones = 0;
+
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        tape_t<T, Less> *s = source[i];
+        while (!is_end(s))
+        {
+            unsigned int length;
+            const T *a = s->read_span(&length);
+            length = std::min(length, BATCH);
+
+            // no branch on the bit: it picks the pile by index, and
+            // the record is stored once, at the end of that pile
+            T *pile[2] = { &staged[0], &staged[BATCH] };
+            unsigned int k[2] = { 0, 0 };
+            for (unsigned int j = 0; j < length; ++j)
+            {
+                const K key = key_of(a[j]);
+                const unsigned int b = (key >> bit) & 1;
+                ors |= key;
+                ands &= key;
+                pile[b][k[b]++] = a[j];
+            }
+            s->skip(length);
+
+            write(d1, pile[0], k[0]);
+            write(d2, pile[1], k[1]);
+            ones += k[1];
+        }
+    }
+    *vary = ors & ~ands;
+    return ones;
+}
+
+/*!
+    LSD radix sort on the tapes, one bit at a time: each pass deals the
+    records out onto the other pair of tapes by the next bit of their
+    keys, and reading the pair back in order keeps them sorted on every
+    bit so far.  The number of passes is fixed by the keys, not by n:
+    one for each bit that isn't the same in all of them.
+
+    That's known before starting for memory and mapped tapes.  For
+    buffered file tapes the first pass (on bit 0) finds it out.  Only
+    for records whose comparator goes by key_of(): see orders_by_key.
+*/
+
+template <class T, class Less>
+void
+sort_radix
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    typedef decltype(key_of(T())) K;
+
+    if (!orders_by_key<Less>::value)
+    {
+        cout << "Radix sorting needs records ordered by key: merging\n";
+        sort_natural(t1, t2, t3, t4);
+        return;
+    }
+
+    tape_t<T, Less> *source1 = t1;
+    tape_t<T, Less> *source2 = t2;
+    tape_t<T, Less> *dest1 = t3;
+    tape_t<T, Less> *dest2 = t4;
+
+    K vary = 0;
+    bool known = key_bits(t1, t2, &vary);
+    unsigned int count = 0;
+    unsigned int bit = 0;
+
+    while (!is_sorted(source1, source2))
+    {
+        if (known)
+        {
+            while (bit < 8 * sizeof(K) && !((vary >> bit) & 1))
+                ++bit;
+        }
+        if (bit == 8 * sizeof(K))
+            break;
+
+        unsigned int ones = radix_pass(source1, source2, dest1, dest2,
+                                       bit, &vary);
+        known = true;
+        cout << "Pass " << count << ": bit " << bit << ", " << ones
+             << " ones\n";
+
+        std::swap(source1, dest1);
+        std::swap(source2, dest2);
+
+        rewind(source1);
+        rewind(source2);
+        rewind(dest1);
+        rewind(dest2);
+        ++bit;
+        ++count;
+        end_pass("radix");
+    }
+
+    cout << "\n\nIn " << count << " passes: ";
+    print(source1, source2);
+    cout << "\n\n\n";
+}
+
+/*!
+    For '-e auto': whether radix sorting the input on t1 and t2 will
+    take fewer passes than merging it.  Radix takes one for each bit
+    that varies; merging about log2 of the number of runs, which the
+    tapes already know, or of what make_runs() will leave.  Radix only
+    gets a look in when key_bits() can tell without a pass.
+*/
+
+template <class T, class Less>
+bool
+radix_pays(tape_t<T, Less> *t1, tape_t<T, Less> *t2)
+{
+    typedef decltype(key_of(T())) K;
+
+    K vary;
+    if (!orders_by_key<Less>::value || !key_bits(t1, t2, &vary))
+        return false;
+
+    unsigned int digits = 0;
+    for ( ; vary; vary &= vary - 1)
+        ++digits;
+
+    unsigned long long runs = t1->descents() + t2->descents() + 2;
+    unsigned int merges = 0;
+    if (run_buffer)
+    {
+        runs = std::min(runs, n / (2ull * run_buffer) + 1);
+        ++merges;
+    }
+    for ( ; (1ull << merges) < runs; ++merges)
+        ;
+    return digits < merges;
+}
+
+/*!
+    '-e auto' once counting is out of the picture: radix if radix_pays(),
+    a natural merge if not.
+*/
+
+template <class T, class Less>
+void
+sort_auto
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    if (radix_pays(t1, t2))
+    {
+        cout << "Engine: radix\n";
+        sort_radix(t1, t2, t3, t4);
+    } else
+    {
+        cout << "Engine: natural\n";
+        sort_natural(t1, t2, t3, t4);
+    }
+}
+
+/*!
+    Writes out what sort_counting() counted, smallest value first, onto
+    t1 and t2 as one long tape: 'counts[v]' copies of each 'v'.
+*/
+
+template <class T, class Less>
+void
+write_counts
+(
+    const std::vector<unsigned int> &counts,
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2
+)
+{
+    const unsigned int BATCH = 4096;
+    T staged[BATCH];
+    unsigned int k = 0;
+
+    const unsigned int domain = counts.size();
+    for (unsigned int v = 0; v < domain; ++v)
+    {
+        for (unsigned int c = counts[v]; c; )
+        {
+            const unsigned int m = std::min(c, BATCH - k);
+            std::fill_n(staged + k, m, T(v));
+            k += m;
+            c -= m;
+            if (k == BATCH)
+            {
+                write(t1, t2, staged, k);
+                k = 0;
+            }
+        }
+    }
+    write(t1, t2, staged, k);
+}
+
+/*!
+    Counting sort, for when every record is a small integer: one pass
+    reads t1 and t2 and counts how many of each value there are, and
+    then writes them out again in order onto t3 and t4.  No comparisons,
+    one pass whatever n is, and the counts take a word for each value
+    in the domain, not for each record.
+
+    Whether the domain is small only shows up during that pass.  The
+    first value outside it spoils things: what has been counted so far
+    goes out in order anyway (a head start of one sorted run), the rest
+    gets copied after it as it comes, and '-e auto' takes it from there
+    on t3 and t4.  Nothing gets read twice.  Memory and mapped tapes
+    get looked over first (key_bits()), so there it doesn't even come
+    to that.
+*/
+
+template <class T, class Less>
+void
+sort_counting
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    sort_counting(t1, t2, t3, t4, counts_values<T, Less>());
+}
+
+template <class T, class Less>
+void
+sort_counting
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4,
+    std::true_type
+)
+{
+    const unsigned int DOMAIN = 1 << 16;
+
+    if (is_sorted(t1, t2))
+    {
+        cout << "\n\nIn 0 passes: ";
+        print(t1, t2);
+        cout << "\n\n\n";
+        return;
+    }
+
+    decltype(key_of(T())) vary, top;
+    if (key_bits(t1, t2, &vary, &top) && top >= DOMAIN)
+    {
+        cout << "Values past " << DOMAIN - 1 << ": merging\n";
+        sort_auto(t1, t2, t3, t4);
+        return;
+    }
+
+    std::vector<unsigned int> counts(DOMAIN);
+    tape_t<T, Less> *source[2] = { t1, t2 };
+    unsigned int counted = 0;
+    bool stray = false;
+
+    for (unsigned int i = 0; i < 2 && !stray; ++i)
+    {
+        tape_t<T, Less> *s = source[i];
+        while (!stray && !is_end(s))
+        {
+            unsigned int length;
+            const T *a = s->read_span(&length);
+            unsigned int j = 0;
+            for ( ; j < length; ++j)
+            {
+                if (key_of(a[j]) >= DOMAIN)
+                {
+                    stray = true;
+                    break;
+                }
+                ++counts[a[j]];
+            }
+            s->skip(j);
+            counted += j;
+        }
+    }
+
+    write_counts(counts, t3, t4);
+
+    if (stray)
+    {
+        cout << "Pass 0: counted " << counted << ", then a value past "
+             << DOMAIN - 1 << ": merging\n";
+
+        for (unsigned int i = 0; i < 2; ++i)
+        {
+            while (!is_end(source[i]))
+            {
+                unsigned int length;
+                const T *a = source[i]->read_span(&length);
+                write(t3, t4, a, length);
+                source[i]->skip(length);
+            }
+        }
+
+        rewind(t1);
+        rewind(t2);
+        rewind(t3);
+        rewind(t4);
+        end_pass("count");
+        sort_auto(t3, t4, t1, t2);
+        return;
+    }
+
+    rewind(t1);
+    rewind(t2);
+    rewind(t3);
+    rewind(t4);
+    end_pass("count");
+
+    cout << "Pass 0: counted " << counted << "\n";
+    cout << "\n\nIn 1 passes: ";
+    print(t3, t4);
+    cout << "\n\n\n";
+}
+
+/*!
+    Records that are more than their key can't be rebuilt from counts.
+*/
+
+template <class T, class Less>
+void
+sort_counting
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4,
+    std::false_type
+)
+{
+    cout << "Counting sort needs integer records: merging\n";
+    sort_auto(t1, t2, t3, t4);
+}
+
+/*!
+    Starts measuring a pass, for '-M': what every tape has done so far
+    and the time.  Nothing without '-M'.
+*/
+
+void
+start_pass()
+{
+    if (!metrics_file)
+        return;
+
+    pass_seen.clear();
+    for (unsigned int i = 0; i < tape_meter::all.size(); ++i)
+    {
+        const tape_meter *m = tape_meter::all[i];
+        tape_delta d = { m->id, m->reads, m->writes, m->rewinds, 0 };
+        pass_seen.push_back(d);
+    }
+    pass_compares = compare_count::asked;
+    pass_start = std::chrono::steady_clock::now();
+}
+
+/*!
+    Ends the pass start_pass() started, adds it to 'passes' as a 'what'
+    pass, and starts the next one.  Tapes that came along since only
+    count from when they were made.
+
+    The engines call this once a pass, so even a pass of a few values
+    costs the time to look over the tapes; with '-j', a task graph's
+    'count' levels overlap, and get measured together as one pass.
+
+    'pass_count' counts them all, '-M' or not.
+*/
+
+void
+end_pass(const char *what, unsigned int count)
+{
+    pass_count += count;
+    if (!metrics_file)
+        return;
+
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+
+    pass_meter p;
+    p.what = what;
+    p.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now - pass_start).count();
+    p.compares = compare_count::asked - pass_compares;
+    for (unsigned int i = 0; i < tape_meter::all.size(); ++i)
+    {
+        const tape_meter *m = tape_meter::all[i];
+        tape_delta d = { m->id, m->reads, m->writes, m->rewinds, 0 };
+        for (unsigned int j = 0; j < pass_seen.size(); ++j)
+        {
+            if (pass_seen[j].id == m->id)
+            {
+                d.reads -= pass_seen[j].reads;
+                d.writes -= pass_seen[j].writes;
+                d.rewinds -= pass_seen[j].rewinds;
+            }
+        }
+        d.bytes = (d.reads + d.writes) * m->size;
+        p.tapes.push_back(d);
+    }
+    passes.push_back(p);
+
+    start_pass();
+}
+
+/*!
+    'passes' as JSON: each pass, with its tapes, and the totals.
+*/
+
+void
+write_metrics(std::ostream &out)
+{
+    const char *engine_name = "?";
+    for (unsigned int i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+    {
+        if (engines[i].engine == engine)
+            engine_name = engines[i].name;
+    }
+
+    tape_delta total = { 0, 0, 0, 0, 0 };
+    unsigned long long ns = 0, compares = 0;
+
+    out << "{\n"
+        << "  \"engine\": \"" << engine_name << "\",\n"
+        << "  \"record\": \"" << records[record].name << "\",\n"
+        << "  \"n\": " << n << ",\n"
+        << "  \"threads\": " << threads << ",\n"
+        << "  \"merge_kernel\": \"" << merge_kernel_name << "\",\n"
+        << "  \"passes\": [";
+    for (unsigned int i = 0; i < passes.size(); ++i)
+    {
+        const pass_meter &p = passes[i];
+        tape_delta sum = { 0, 0, 0, 0, 0 };
+        for (unsigned int j = 0; j < p.tapes.size(); ++j)
+        {
+            sum.reads += p.tapes[j].reads;
+            sum.writes += p.tapes[j].writes;
+            sum.rewinds += p.tapes[j].rewinds;
+            sum.bytes += p.tapes[j].bytes;
+        }
+
+        out << (i ? "," : "") << "\n"
+            << "    { \"pass\": " << i << ", \"what\": \"" << p.what
+            << "\", \"ns\": " << p.ns
+            << ", \"comparisons\": " << p.compares
+            << ", \"reads\": " << sum.reads
+            << ", \"writes\": " << sum.writes
+            << ", \"rewinds\": " << sum.rewinds
+            << ", \"bytes\": " << sum.bytes << ",\n"
+            << "      \"tapes\": [";
+        for (unsigned int j = 0; j < p.tapes.size(); ++j)
+        {
+            const tape_delta &d = p.tapes[j];
+            out << (j ? "," : "") << "\n"
+                << "        { \"tape\": " << d.id
+                << ", \"reads\": " << d.reads
+                << ", \"writes\": " << d.writes
+                << ", \"rewinds\": " << d.rewinds
+                << ", \"bytes\": " << d.bytes << " }";
+        }
+        out << (p.tapes.empty() ? "" : "\n      ") << "] }";
+
+        ns += p.ns;
+        compares += p.compares;
+        total.reads += sum.reads;
+        total.writes += sum.writes;
+        total.rewinds += sum.rewinds;
+        total.bytes += sum.bytes;
+    }
+    out << (passes.empty() ? "" : "\n  ") << "],\n"
+        << "  \"total\": { \"passes\": " << passes.size()
+        << ", \"ns\": " << ns
+        << ", \"comparisons\": " << compares
+        << ", \"reads\": " << total.reads
+        << ", \"writes\": " << total.writes
+        << ", \"rewinds\": " << total.rewinds
+        << ", \"bytes\": " << total.bytes << " }\n"
+        << "}\n";
+}
+
+/*!
+    Does the real work, with whichever engine was asked for.
+*/
+
+template <class T, class Less>
+void
+sort
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    // the input has just been written: back to the start of it
+    rewind(t1);
+    rewind(t2);
+    rewind(t3);
+    rewind(t4);
+    size_tapes(t1, t2, t3, t4);
+    start_pass();
+
+    switch (engine)
+    {
+    case CLASSIC:
+        sort_classic(t1, t2, t3, t4);
+        break;
+
+    case NATURAL:
+        sort_natural(t1, t2, t3, t4);
+        break;
+
+    case POLYPHASE:
+        sort_polyphase(t1, t2, t3, t4);
+        break;
+
+    case KWAY:
+        sort_kway(t1, t2, t3, t4);
+        break;
+
+    case RADIX:
+        sort_radix(t1, t2, t3, t4);
+        break;
+
+    case COUNTING:
+        sort_counting(t1, t2, t3, t4);
+        break;
+
+    case AUTO:
+        if (counts_values<T, Less>::value)
+        {
+            cout << "Engine: counting\n";
+            sort_counting(t1, t2, t3, t4);
+        } else
+            sort_auto(t1, t2, t3, t4);
+        break;
+    }
+}
+
+/*!
+    The key a record is sorted on: for a plain number, all of it.
+*/
+
+template <class T>
+T
+key_of(const T &r)
+{
+    return r;
+}
+
+uint64_t
+key_of(const wide_record &r)
+{
+    return r.key;
+}
+
+template <class K>
+K
+key_of(const key_ref<K> &r)
+{
+    return r.key;
+}
+
+/*!
+    Key/pointer sorting ('-p'): the tapes only ever carry a key_ref for
+    each record, and the records themselves get moved once, at the end.
+    An ordinary sort moves every record whole on every pass, so for
+    records much bigger than their keys, most of what it moves is
+    payload going along for the ride.
+
+    The records are read into memory and stay put there: a real system
+    would leave them in the input file and fetch them by position.  The
+    key_refs go onto the tapes just the way the records were laid out,
+    and they compare on keys alone, so the engine makes exactly the
+    moves it would have made on the records, and the final gather pass
+    puts them back on t1 and t2 in the same order it would have left
+    them.
+*/
+
+template <class T, class Less>
+void
+sort_keys
+(
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    tape_t<T, Less> *t3,
+    tape_t<T, Less> *t4
+)
+{
+    typedef decltype(key_of(T())) K;
+    typedef key_ref<K> ref_t;
+    const unsigned int BATCH = 4096;
+
+    rewind(t1);
+    rewind(t2);
+    std::vector<T> records(n);
+    const unsigned int count = read(t1, t2, records.data(), n);
+
+    tape_t<ref_t, typename ref_order<Less, K>::type> k[4];
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        if (tape_dir)
+            k[i].attach(tape_dir, map_tapes, tape_depth);
+    }
+    size_tapes(&k[0], &k[1], &k[2], &k[3]);
+
+    std::vector<ref_t> refs(BATCH);
+    for (unsigned int i = 0; i < count; i += BATCH)
+    {
+        const unsigned int length = std::min(BATCH, count - i);
+        for (unsigned int j = 0; j < length; ++j)
+        {
+            refs[j].key = key_of(records[i + j]);
+            refs[j].index = i + j;
+        }
+        write(&k[0], &k[1], refs.data(), length);
+    }
+
+    sort(&k[0], &k[1], &k[2], &k[3]);
+
+    // the gather pass: the engines leave the sorted key_refs on the
+    // first of the four tapes in order, with nothing on the rest
+    rewind(t1);
+    rewind(t2);
+    rewind(t3);
+    rewind(t4);
+    std::vector<T> out(BATCH);
+    for (unsigned int i = 0; i < 4; ++i)
+    {
+        unsigned int got;
+        while ((got = read(&k[i], refs.data(), BATCH)))
+        {
+            for (unsigned int j = 0; j < got; ++j)
+                out[j] = records[refs[j].index];
+            write(t1, t2, out.data(), got);
+        }
+    }
+    end_pass("gather");
+    cout << "Gathered " << count << " records of " << sizeof(T)
+         << " bytes, sorted as " << sizeof(ref_t) << " byte keys\n";
+}
+
+/*!
+    A record with key 'value', for filling the tapes with.
+*/
+
+template <class T>
+T
+make_record(unsigned int value)
+{
+    return T(value);
+}
+
+/*!
+    The payload gets the key's low byte all the way through, so it's
+    easy to see whether it stayed with its key.
+*/
+
+template <>
+wide_record
+make_record<wide_record>(unsigned int value)
+{
+    wide_record r;
+    r.key = value;
+    memset(r.payload, value & 0xff, sizeof(r.payload));
+    return r;
+}
+
+/*!
+    Fills four tapes of 'T' with test 'bob', and sorts them.  'size' is
+    n, if it was given.
+*/
+
+template <class T, class Less>
+void
+run_test(test_type bob, const char *size)
+{
+    tape_t<T, Less> t1;
+    tape_t<T, Less> t2;
+    tape_t<T, Less> t3;
+    tape_t<T, Less> t4;
+
+    if (tape_dir)
+    {
+        t1.attach(tape_dir, map_tapes, tape_depth);
+        t2.attach(tape_dir, map_tapes, tape_depth);
+        t3.attach(tape_dir, map_tapes, tape_depth);
+        t4.attach(tape_dir, map_tapes, tape_depth);
+    }
+
+    switch (bob)
+    {
+
+    case MANUAL:
+
+        // fill the tape
+        n = 8;
+        write(&t1, &t2, make_record<T>(1));
+        write(&t1, &t2, make_record<T>(19));
+        write(&t1, &t2, make_record<T>(17));
+        write(&t1, &t2, make_record<T>(3));
+        write(&t1, &t2, make_record<T>(56));
+        write(&t1, &t2, make_record<T>(42));
+        write(&t1, &t2, make_record<T>(5));
+        write(&t1, &t2, make_record<T>(18));
+        if (key_sort)
+            sort_keys(&t1, &t2, &t3, &t4);
+        else
+            sort(&t1, &t2, &t3, &t4);
+
+        break;
+
+    case AUTOMATIC:
+    {
+        if (size)
+            n = atoi(size);
+        else
+        {
+            while (!n)              // sometimes drand48() returns 0.  Boring.
+            {
+                // generate a random length for the array
+                n = RAND(unsigned int, MAX_N);
+                if (n & 1)          // 'n' odd.  Details: blah.  Make even.
+                    ++n;
+            }
+        }
+
+        cout << "n == '" << n << "'\n";
+
+        // room on every tape for all of the data, once, here: the
+        // sort then finds its tapes already sized, every iteration
+        size_tapes(&t1, &t2, &t3, &t4);
+
+        for (unsigned int i = 0; i < ITERATIONS; ++i)
+        {
+            cout << "\nIteration " << i << " of " << ITERATIONS << "\n";
+            t1.clear();
+            t2.clear();
+            t3.clear();
+            t4.clear();
+
+            // generate random data
+            for (unsigned int i = 0; i < n; ++i)
+            {
+                unsigned int d = RAND(unsigned int, MAX_VALUE);
+                cout << "Picked random # " << d << "\n";
+                write(&t1, &t2, make_record<T>(d));
+            }
+
+            print(&t1, &t2);
+            if (key_sort)
+                sort_keys(&t1, &t2, &t3, &t4);
+            else
+                sort(&t1, &t2, &t3, &t4);
+        }
+    }
+    break;
+
+    default:
+        cout << "Unknown test " << bob << "\n";
+    }
+}
+
+/*!
+    run_test(), or run_stream() for '-i', with comparisons counted if
+    '-M' wants them.
+*/
+
+template <class T, class Less>
+void
+run_measured(test_type bob, const char *size)
+{
+    if (stream_in && metrics_file)
+        run_stream<T, counted_less<Less> >();
+    else if (stream_in)
+        run_stream<T, Less>();
+    else if (metrics_file)
+        run_test<T, counted_less<Less> >(bob, size);
+    else
+        run_test<T, Less>(bob, size);
+}
+
+/*!
+    'count' values of input 'kind' for bench(), the same ones every time
+    for the same 'seed':
+
+        uniform     anything from 0 to 2^32 - 1
+        sorted      the same, in order
+        reverse     ... and backwards
+        nearly      sorted, with 1% of them swapped somewhere else
+        few         sixteen different values, in no order
+        organ       up to the middle and back down again
+*/
+
+void
+generate
+(
+    input_type kind,
+    unsigned int count,
+    unsigned int seed,
+    std::vector<unsigned int> *out
+)
+{
+    std::mt19937 random(seed);
+    out->resize(count);
+
+    switch (kind)
+    {
+    case UNIFORM:
+    case SORTED:
+    case REVERSE:
+    case NEARLY:
+        for (unsigned int i = 0; i < count; ++i)
+            (*out)[i] = random();
+        if (kind != UNIFORM)
+            std::sort(out->begin(), out->end());
+        if (kind == REVERSE)
+            std::reverse(out->begin(), out->end());
+        if (kind == NEARLY)
+        {
+            for (unsigned int i = 0; i < count / 100; ++i)
+                std::swap((*out)[random() % count], (*out)[random() % count]);
+        }
+        break;
+
+    case FEW:
+        for (unsigned int i = 0; i < count; ++i)
+            (*out)[i] = random() % 16;
+        break;
+
+    case ORGAN:
+        for (unsigned int i = 0; i < count; ++i)
+            (*out)[i] = std::min(i, count - 1 - i);
+        break;
+    }
+}
+
+/*!
+    '-B runs': sorts each input generate() knows, at every power of ten
+    from 1000 up to 'max_n', 'runs' times with every engine (or just
+    the one '-e' asked for, if 'every_engine' is false), and prints a
+    line of CSV for each: median and 99th percentile time, passes, and
+    values sorted a second at the median.
+
+    Only the sort gets timed, not filling the tapes, and cout is shut
+    off while it runs, so what the engines print costs nothing.  The
+    classic engine is left out unless asked for: it only takes some n.
+*/
+
+template <class T, class Less>
+void
+bench(unsigned int max_n, bool every_engine)
+{
+    cout << "engine,input,record,n,runs,threads,kernel,"
+         << "median_ns,p99_ns,passes,values_per_sec\n";
+
+    const engine_type asked = engine;
+    std::vector<unsigned int> values;
+    std::vector<T> data;
+    std::vector<unsigned long long> times(bench_runs);
+
+    for (unsigned long long size = 1000; size <= max_n; size *= 10)
+    {
+        n = size;
+        tape_t<T, Less> t1;
+        tape_t<T, Less> t2;
+        tape_t<T, Less> t3;
+        tape_t<T, Less> t4;
+        if (tape_dir)
+        {
+            t1.attach(tape_dir, map_tapes, tape_depth);
+            t2.attach(tape_dir, map_tapes, tape_depth);
+            t3.attach(tape_dir, map_tapes, tape_depth);
+            t4.attach(tape_dir, map_tapes, tape_depth);
+        }
+        size_tapes(&t1, &t2, &t3, &t4);
+
+        for (unsigned int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i)
+        {
+            generate(inputs[i].input, n, bench_seed, &values);
+            data.resize(n);
+            for (unsigned int j = 0; j < n; ++j)
+                data[j] = make_record<T>(values[j]);
+
+            for (unsigned int e = 0; e < sizeof(engines) / sizeof(engines[0]);
+                 ++e)
+            {
+                engine = engines[e].engine;
+                if (every_engine ? engine == CLASSIC : engine != asked)
+                    continue;
+
+                unsigned int passes = 0;
+                for (unsigned int r = 0; r < bench_runs; ++r)
+                {
+                    t1.clear();
+                    t2.clear();
+                    t3.clear();
+                    t4.clear();
+                    write(&t1, &t2, data.data(), n);
+
+                    pass_count = 0;
+                    cout.setstate(std::ios::badbit);
+                    const std::chrono::steady_clock::time_point start =
+                        std::chrono::steady_clock::now();
+                    if (key_sort)
+                        sort_keys(&t1, &t2, &t3, &t4);
+                    else
+                        sort(&t1, &t2, &t3, &t4);
+                    times[r] = std::chrono::duration_cast<
+                        std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+                    cout.clear();
+                    passes = pass_count;
+                }
+
+                std::sort(times.begin(), times.end());
+                const unsigned long long median = times[times.size() / 2];
+                const unsigned long long p99 =
+                    times[(times.size() * 99 + 99) / 100 - 1];
+                cout << engines[e].name << "," << inputs[i].name << ","
+                     << records[record].name << "," << n << ","
+                     << bench_runs << "," << threads << ","
+                     << merge_kernel_name << "," << median << "," << p99
+                     << "," << passes << ","
+                     << (median ? n * 1e9 / median : 0) << "\n";
+            }
+        }
+    }
+    engine = asked;
+}
+
+/*!
+    Anything wrong with '-i' or '-o' ends the sort.  It goes to cerr:
+    cout may well be where the sorted records are going.
+*/
+
+void
+stream_error(const char *name, const char *what)
+{
+    std::cerr << name << ": " << what << "\n";
+    exit(1);
+}
+
+/*!
+    The file '-i' or '-o' named, '-' being stdin or stdout.  An output
+    file isn't truncated yet: it may be the input too.
+*/
+
+int
+open_stream(const char *name, bool out)
+{
+    if (!strcmp(name, "-"))
+        return out ? 1 : 0;
+    const int fd = out ? open(name, O_WRONLY | O_CREAT, 0666)
+                       : open(name, O_RDONLY);
+    if (fd < 0)
+        stream_error(name, strerror(errno));
+    return fd;
+}
+
+/*!
+    All of 'length' bytes at 'd' out to 'fd', however many write()s
+    that takes.
+*/
+
+void
+write_out(int fd, const char *d, size_t length)
+{
+    while (length)
+    {
+        const ssize_t put = ::write(fd, d, length);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            stream_error(stream_out, strerror(errno));
+        d += put;
+        length -= put;
+    }
+}
+
+/*!
+    'key' in decimal at 'to', which has room for the 20 digits of the
+    biggest there is.  Returns how many digits that took.
+
+    The digits come off the bottom two at a time, out of DIGIT_PAIRS,
+    so there's half the dividing there'd be one at a time (and the
+    compiler turns dividing by 100 into a multiply anyway).
+*/
+
+unsigned int
+format_key(uint64_t key, char *to)
+{
+    char digits[20];
+    char *d = digits + sizeof(digits);
+    while (key >= 100)
+    {
+        const unsigned int pair = key % 100;
+        key /= 100;
+        d -= 2;
+        memcpy(d, &DIGIT_PAIRS[2 * pair], 2);
+    }
+    if (key >= 10)
+    {
+        d -= 2;
+        memcpy(d, &DIGIT_PAIRS[2 * key], 2);
+    }
+    else
+        *--d = '0' + key;
+
+    const unsigned int length = digits + sizeof(digits) - d;
+    memcpy(to, d, length);
+    return length;
+}
+
+/*!
+    How many of the 8 characters in 'chars' (the first in the low byte,
+    as a little-endian load leaves them) are digits before anything
+    else turns up.
+
+    A byte is a digit if its high nibble is 3 and adding 6 to it
+    doesn't change that.  The add can carry into the next byte up, but
+    only out of a byte that's no digit already, and nothing after that
+    one counts.
+*/
+
+unsigned int
+digit_run(uint64_t chars)
+{
+    const uint64_t high = 0xf0f0f0f0f0f0f0f0ull;
+    const uint64_t threes = 0x3030303030303030ull;
+    const uint64_t odd = ((chars & high) ^ threes) |
+                         (((chars + 0x0606060606060606ull) & high) ^ threes);
+    return odd ? __builtin_ctzll(odd) / 8 : 8;
+}
+
+/*!
+    The number the first 'length' (1 to 8) characters of 'chars' spell,
+    all in one register: the digits get shifted up to the top, so the
+    bytes below them read as leading zeroes, and then pairs, quads and
+    the two halves get put together with a multiply each.
+*/
+
+uint64_t
+parse_digits(uint64_t chars, unsigned int length)
+{
+    chars -= 0x3030303030303030ull;
+    chars <<= 8 * (8 - length);
+    chars = chars * 10 + (chars >> 8);
+    chars = ((chars & 0x000000ff000000ffull) * (100 + (1000000ull << 32)) +
+             ((chars >> 16) & 0x000000ff000000ffull) *
+                 (1 + (10000ull << 32))) >> 32;
+    return chars;
+}
+
+/*!
+    The record a key read off text turns into: make_record() for keys
+    that may not fit in 32 bits.
+*/
+
+template <class T>
+T
+record_of(uint64_t key)
+{
+    return T(key);
+}
+
+template <>
+wide_record
+record_of<wide_record>(uint64_t key)
+{
+    wide_record r;
+    r.key = key;
+    memset(r.payload, key & 0xff, sizeof(r.payload));
+    return r;
+}
+
+/*!
+    Puts the records read so far on t1 or t2, turn about, so the input
+    ends up split between them (give or take a batch) without anybody
+    having to know n beforehand.
+*/
+
+template <class T, class Less>
+void
+deal
+(
+    std::vector<T> *batch,
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    unsigned int *batches
+)
+{
+    if (batch->empty())
+        return;
+    if (batch->size() > std::numeric_limits<unsigned int>::max() - n)
+        stream_error(stream_in, "too many records");
+
+    write((*batches)++ & 1 ? t2 : t1, batch->data(), batch->size());
+    n += batch->size();
+    batch->clear();
+}
+
+/*!
+    Parses the keys from 'p' up to 'end' into 'batch', dealing it out
+    whenever it fills up.  The keys are whole: the text ends with white
+    space.  It's read 8 characters at a time, so there has to be room
+    to read 7 past 'end'.
+
+    Keys of 19 digits or fewer can't overflow; any longer get checked a
+    digit at a time.
+*/
+
+template <class T, class Less>
+void
+parse_keys
+(
+    const char *p,
+    const char *end,
+    std::vector<T> *batch,
+    tape_t<T, Less> *t1,
+    tape_t<T, Less> *t2,
+    unsigned int *batches
+)
+{
+    const uint64_t most = std::numeric_limits<decltype(key_of(T()))>::max();
+
+    while (p < end)
+    {
+        if (isspace((unsigned char)*p))
+        {
+            ++p;
+            continue;
+        }
 
-            print_all(x, y, source1, source2, dest1, dest2);
+        const char *first = p;
+        uint64_t key = 0;
+        for (;;)
+        {
+            uint64_t chars;
+            memcpy(&chars, p, sizeof(chars));
+            const unsigned int length = digit_run(chars);
+            if (!length)
+                break;
+            key = key * POWERS_OF_TEN[length] + parse_digits(chars, length);
+            p += length;
+            if (length < 8)
+                break;
         }
 
-        // source tapes are empty: switch source and dest pointers
-        std::swap(source1, dest1);
-        std::swap(source2, dest2);
+        if (p == first || !isspace((unsigned char)*p))
+            stream_error(stream_in, "not a number");
+        if (p - first > 19)
+        {
+            key = 0;
+            for (const char *d = first; d < p; ++d)
+            {
+                const unsigned int digit = *d - '0';
+                if (key > (most - digit) / 10)
+                    stream_error(stream_in, "key too big for the record");
+                key = key * 10 + digit;
+            }
+        }
+        else if (key > most)
+            stream_error(stream_in, "key too big for the record");
 
-        // Another pass (over n elements) complete: rewind tapes
-        rewind(source1);
-        rewind(source2);
-        rewind(dest1);
-        rewind(dest2);
-        ++count;
-        cross = !cross;
+        batch->push_back(record_of<T>(key));
+        if (batch->size() == STREAM_BATCH)
+            deal(batch, t1, t2, batches);
     }
-
-    cout << "\n\nIn " << count << " passes: ";
-    print(source1, source2);
-    cout << "\n\n\n";
 }
 
-int
-main(int argc, char *argv[])
+/*!
+    '-F text': one key a line, in decimal.  Any white space will do
+    between them, but nothing else, and a key has to fit the record's
+    key.  Counts n as it goes.
+
+    Each read() fills up what the last one left over: the key it cut
+    off, which gets parsed with the rest next time around.
+*/
+
+template <class T, class Less>
+void
+read_text(int fd, tape_t<T, Less> *t1, tape_t<T, Less> *t2)
 {
-    tape_t t1;
-    tape_t t2;
-    tape_t t3;
-    tape_t t4;
+    // room past the end for a newline, and for parse_keys() to overrun
+    std::vector<char> in(STREAM_BUFFER + 16);
+    std::vector<T> batch;
+    batch.reserve(STREAM_BATCH);
+    unsigned int batches = 0;
+    size_t kept = 0;
 
-    test_type bob = AUTOMATIC;
+    for (;;)
+    {
+        const ssize_t got = ::read(fd, &in[kept], STREAM_BUFFER - kept);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            stream_error(stream_in, strerror(errno));
 
-    switch (bob)
+        size_t end = kept + got;
+        if (!got)                       // whatever's left is all there is
+        {
+            in[end++] = '\n';
+            parse_keys(&in[0], &in[end], &batch, t1, t2, &batches);
+            break;
+        }
+
+        size_t cut = end;
+        while (cut && !isspace((unsigned char)in[cut - 1]))
+            --cut;
+        if (!cut && end == STREAM_BUFFER)
+            stream_error(stream_in, "key too big for the record");
+
+        parse_keys(&in[0], &in[cut], &batch, t1, t2, &batches);
+        memmove(&in[0], &in[cut], end - cut);
+        kept = end - cut;
+    }
+    deal(&batch, t1, t2, &batches);
+}
+
+/*!
+    '-F binary': the records themselves, in the machine's byte order
+    (little-endian, anywhere this is likely to run).  They're read
+    straight into the batch that goes onto the tapes.
+*/
+
+template <class T, class Less>
+void
+read_binary(int fd, tape_t<T, Less> *t1, tape_t<T, Less> *t2)
+{
+    std::vector<T> batch;
+    batch.reserve(STREAM_BATCH);
+    unsigned int batches = 0;
+    const size_t room = STREAM_BATCH * sizeof(T);
+
+    for (;;)
     {
+        batch.resize(STREAM_BATCH);
+        char *to = reinterpret_cast<char *>(batch.data());
+        size_t filled = 0;
+        while (filled < room)
+        {
+            const ssize_t got = ::read(fd, to + filled, room - filled);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                stream_error(stream_in, strerror(errno));
+            if (!got)
+                break;
+            filled += got;
+        }
 
-    case MANUAL:
+        if (filled % sizeof(T))
+            stream_error(stream_in, "ends partway through a record");
+        batch.resize(filled / sizeof(T));
+        const bool last = filled < room;
+        deal(&batch, t1, t2, &batches);
+        if (last)
+            return;
+    }
+}
 
-        // fill the tape
-        n = 8;
-        write(&t1, &t2, 1);
-        write(&t1, &t2, 19);
-        write(&t1, &t2, 17);
-        write(&t1, &t2, 3);
-        write(&t1, &t2, 56);
-        write(&t1, &t2, 42);
-        write(&t1, &t2, 5);
-        write(&t1, &t2, 18);
-        sort(&t1, &t2, &t3, &t4);
+/*!
+    The keys on 'count' tapes, one after the other, a line each.  They
+    get formatted into a buffer that goes out STREAM_BUFFER bytes at a
+    time.
+*/
 
-        break;
+template <class T, class Less>
+void
+write_text(int fd, tape_t<T, Less> *const *tapes, unsigned int count)
+{
+    std::vector<char> out(STREAM_BUFFER);
+    size_t used = 0;
 
-    case AUTOMATIC:
+    for (unsigned int i = 0; i < count; ++i)
     {
-        if (argv[1])
-            n = atoi(argv[1]);
-        else
+        tape_t<T, Less> *t = tapes[i];
+        while (!is_end(t))
         {
-            while (!n)              // sometimes drand48() returns 0.  Boring.
+            unsigned int length;
+            const T *span = t->read_span(&length);
+            for (unsigned int j = 0; j < length; ++j)
             {
-                // generate a random length for the array
-                n = RAND(unsigned int, MAX_N);
-                if (n & 1)          // 'n' odd.  Details: blah.  Make even.
-                    ++n;
+                if (out.size() - used < 21)
+                {
+                    write_out(fd, &out[0], used);
+                    used = 0;
+                }
+                used += format_key(key_of(span[j]), &out[used]);
+                out[used++] = '\n';
             }
+            t->skip(length);
         }
+    }
+    write_out(fd, &out[0], used);
+}
 
-        cout << "n == '" << n << "'\n";
+/*!
+    The records on 'count' tapes as they are.  Spans are big enough to
+    go straight out.
+*/
 
-        for (unsigned int i = 0; i < ITERATIONS; ++i)
+template <class T, class Less>
+void
+write_binary
+(
+    int fd,
+    tape_t<T, Less> *const *tapes,
+    unsigned int count
+)
+{
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        tape_t<T, Less> *t = tapes[i];
+        while (!is_end(t))
         {
-            cout << "\nIteration " << i << " of " << ITERATIONS << "\n";
-            t1.clear();
-            t2.clear();
-            t3.clear();
-            t4.clear();
+            unsigned int length;
+            const T *span = t->read_span(&length);
+            write_out(fd, reinterpret_cast<const char *>(span),
+                      size_t(length) * sizeof(T));
+            t->skip(length);
+        }
+    }
+}
 
-            // generate random data
-            for (unsigned int i = 0; i < n; ++i)
+/*!
+    '-i': sorts whatever '-i' names into '-o', instead of a test.  The
+    records get dealt onto t1 and t2 while they're parsed, so there's
+    never a copy of the whole input anywhere but on the tapes, and the
+    engine that sorts them doesn't get to print anything.
+
+    That leaves t1 and t2 a batch or so apart rather than split at n/2,
+    which the classic engine can't cope with: it's turned away.
+*/
+
+template <class T, class Less>
+void
+run_stream()
+{
+    if (engine == CLASSIC)
+        stream_error(stream_in, "the classic engine can't sort a stream");
+
+    tape_t<T, Less> t1;
+    tape_t<T, Less> t2;
+    tape_t<T, Less> t3;
+    tape_t<T, Less> t4;
+    if (tape_dir)
+    {
+        t1.attach(tape_dir, map_tapes, tape_depth);
+        t2.attach(tape_dir, map_tapes, tape_depth);
+        t3.attach(tape_dir, map_tapes, tape_depth);
+        t4.attach(tape_dir, map_tapes, tape_depth);
+    }
+
+    // a bad '-o' should fail before the sort, not after it
+    const int out = open_stream(stream_out, true);
+    const int in = open_stream(stream_in, false);
+    n = 0;
+    if (stream_text)
+        read_text(in, &t1, &t2);
+    else
+        read_binary(in, &t1, &t2);
+    if (in)
+        close(in);
+
+    cout.setstate(std::ios::badbit);
+    if (n)
+    {
+        if (key_sort)
+            sort_keys(&t1, &t2, &t3, &t4);
+        else
+            sort(&t1, &t2, &t3, &t4);
+    }
+    cout.clear();
+
+    struct stat file;
+    if (fstat(out, &file) == 0 && S_ISREG(file.st_mode) &&
+        ftruncate(out, 0) < 0)
+        stream_error(stream_out, strerror(errno));
+
+    // the sorted records are t1 to t4, end to end
+    tape_t<T, Less> *const tapes[4] = { &t1, &t2, &t3, &t4 };
+    for (unsigned int i = 0; i < 4; ++i)
+        rewind(tapes[i]);
+
+    if (stream_text)
+        write_text(out, tapes, 4);
+    else
+        write_binary(out, tapes, 4);
+    if (out != 1 && close(out))
+        stream_error(stream_out, strerror(errno));
+}
+
+/*!
+    Looks up an engine by the name given to '-e'.  Returns false if
+    there's no such engine.
+*/
+
+bool
+parse_engine(const char *name, engine_type *e)
+{
+    const unsigned int count = sizeof(engines) / sizeof(engines[0]);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (!strcmp(name, engines[i].name))
+        {
+            *e = engines[i].engine;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+    The same for '-r' and record types.
+*/
+
+bool
+parse_record(const char *name, record_type *r)
+{
+    const unsigned int count = sizeof(records) / sizeof(records[0]);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (!strcmp(name, records[i].name))
+        {
+            *r = records[i].record;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+usage(const char *program)
+{
+    cout << "usage: " << program << " [-e engine] [-b run buffer] [-k tapes]"
+         << " [-f|-m tape dir] [-q depth] [-j threads] [-r record] [-p] [-H]"
+         << " [-M metrics.json] [-B runs [-s seed]] [-T] [n]\n"
+         << "       " << program << " -i in [-o out] [-F text|binary]"
+         << " [sort options]\n"
+         << "engines:";
+    const unsigned int count = sizeof(engines) / sizeof(engines[0]);
+    for (unsigned int i = 0; i < count; ++i)
+        cout << " " << engines[i].name;
+    cout << "\nrecords:";
+    const unsigned int kinds = sizeof(records) / sizeof(records[0]);
+    for (unsigned int i = 0; i < kinds; ++i)
+        cout << " " << records[i].name;
+    cout << "\n-B inputs:";
+    const unsigned int shapes = sizeof(inputs) / sizeof(inputs[0]);
+    for (unsigned int i = 0; i < shapes; ++i)
+        cout << " " << inputs[i].name;
+    cout << "\n";
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_type bob = AUTOMATIC;
+    bool every_engine = true;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:e:f:i:j:k:m:o:pq:r:s:B:F:HM:T")) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            run_buffer = atoi(optarg);
+            break;
+
+        case 'e':
+            if (!parse_engine(optarg, &engine))
             {
-                unsigned int d = RAND(unsigned int, MAX_VALUE);
-                cout << "Picked random # " << d << "\n";
-                write(&t1, &t2, d);
+                usage(argv[0]);
+                return 1;
             }
+            every_engine = false;
+            break;
 
-            print(&t1, &t2);
-            sort(&t1, &t2, &t3, &t4);
+        case 'f':
+            tape_dir = optarg;
+            map_tapes = false;
+            break;
+
+        case 'm':
+            tape_dir = optarg;
+            map_tapes = true;
+            break;
+
+        case 'j':
+            threads = atoi(optarg);     // 0: one per core
+            if (!threads)
+                threads = std::max(std::thread::hardware_concurrency(), 1u);
+            break;
+
+        case 'r':
+            if (!parse_record(optarg, &record))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'p':
+            key_sort = true;
+            break;
+
+        case 'H':
+            huge_pages = true;
+            break;
+
+        case 'M':
+            metrics_file = optarg;      // '-': cout
+            break;
+
+        case 'B':
+            bench_runs = atoi(optarg);
+            if (!bench_runs)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 's':
+            bench_seed = atoi(optarg);
+            break;
+
+        case 'i':
+            stream_in = optarg;
+            break;
+
+        case 'o':
+            stream_out = optarg;
+            break;
+
+        case 'F':
+            if (!strcmp(optarg, "text"))
+                stream_text = true;
+            else if (!strcmp(optarg, "binary"))
+                stream_text = false;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'T':
+            trace_ring = true;          // needs TRACE_LEVEL > 0 to see any
+            signal(SIGABRT, dump_trace_on_abort);
+            break;
+
+        case 'q':
+            tape_depth = atoi(optarg);
+            if (tape_depth < 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'k':
+            tape_count = atoi(optarg);
+            if (tape_count < 4)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
         }
     }
-    break;
 
-    default:
-        cout << "Unknown test " << bob << "\n";
+    if (stream_in && metrics_file && !strcmp(metrics_file, "-") &&
+        !strcmp(stream_out, "-"))
+        stream_error("-M -", "stdout already has the sorted records");
+
+    if (record == U32)
+        merge_kernel = pick_merge_kernel(&merge_kernel_name);
+    if (!bench_runs && !stream_in)
+        cout << "Merge kernel: " << merge_kernel_name << "\n";
+
+    if (threads > 1)
+        pool = new worker_pool(threads);
+
+    const char *size = optind < argc ? argv[optind] : 0;
+    if (bench_runs)
+    {
+        // up to 10^8 unless told otherwise
+        const unsigned int max_n = size ? atoi(size) : 100000000;
+        switch (record)
+        {
+        case U32:
+            bench<data_t, std::less<data_t> >(max_n, every_engine);
+            break;
+
+        case U64:
+            bench<uint64_t, std::less<uint64_t> >(max_n, every_engine);
+            break;
+
+        case WIDE:
+            bench<wide_record, key_less>(max_n, every_engine);
+            break;
+        }
+        delete pool;
+        return 0;
+    }
+
+    switch (record)
+    {
+    case U32:
+        run_measured<data_t, std::less<data_t> >(bob, size);
+        break;
+
+    case U64:
+        run_measured<uint64_t, std::less<uint64_t> >(bob, size);
+        break;
+
+    case WIDE:
+        run_measured<wide_record, key_less>(bob, size);
+        break;
+    }
+
+    // with '-i', cout may be the sorted records
+    if (trace_ring)
+        dump_trace(stream_in ? std::cerr : cout);
+
+    if (metrics_file && !strcmp(metrics_file, "-"))
+        write_metrics(cout);
+    else if (metrics_file)
+    {
+        std::ofstream out(metrics_file);
+        write_metrics(out);
+        if (!out)
+            cout << "Couldn't write metrics to " << metrics_file << "\n";
     }
 
+    delete pool;
     return 0;
 }
 